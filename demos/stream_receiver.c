@@ -0,0 +1,294 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Companion receiver for sommelier's damage stream. It reconstructs the
+// surfaces of a sommelier running with --shm-driver=stream and presents
+// each of them in its own window on the compositor it connects to. Usage:
+//
+//   sommelier_stream_receiver [FD]
+//
+// where FD is the read end of the stream, standard input by default.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "sommelier-stream.h"
+#include "xdg-shell-unstable-v6-client-protocol.h"
+
+struct receiver {
+  struct wl_display* display;
+  struct wl_compositor* compositor;
+  struct wl_shm* shm;
+  struct zxdg_shell_v6* xdg_shell;
+  struct receiver_surface* surfaces;
+};
+
+struct receiver_surface {
+  struct receiver* receiver;
+  uint32_t id;
+  struct wl_surface* surface;
+  struct zxdg_surface_v6* xdg_surface;
+  struct zxdg_toplevel_v6* toplevel;
+  struct wl_buffer* buffer;
+  uint8_t* data;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  int configured;
+  int busy;
+  // Latest contents, kept until the host buffer is free to update.
+  uint8_t* contents;
+  int dirty;
+  struct receiver_surface* next;
+};
+
+static void receiver_surface_present(struct receiver_surface* surface);
+
+static void receiver_buffer_release(void* data, struct wl_buffer* buffer) {
+  struct receiver_surface* surface = (struct receiver_surface*)data;
+
+  surface->busy = 0;
+  receiver_surface_present(surface);
+}
+
+static const struct wl_buffer_listener receiver_buffer_listener = {
+    receiver_buffer_release};
+
+static void receiver_surface_present(struct receiver_surface* surface) {
+  size_t size = surface->width * surface->height * 4;
+
+  if (!surface->configured || surface->busy || !surface->dirty)
+    return;
+
+  if (!surface->buffer) {
+    struct wl_shm_pool* pool;
+    int fd = memfd_create("sommelier-stream-receiver", MFD_CLOEXEC);
+
+    if (fd == -1 || ftruncate(fd, size)) {
+      fprintf(stderr, "error: buffer allocation failed: %s\n",
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    surface->data =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (surface->data == MAP_FAILED) {
+      fprintf(stderr, "error: buffer mapping failed: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    pool = wl_shm_create_pool(surface->receiver->shm, fd, size);
+    surface->buffer =
+        wl_shm_pool_create_buffer(pool, 0, surface->width, surface->height,
+                                  surface->width * 4, surface->format);
+    wl_buffer_add_listener(surface->buffer, &receiver_buffer_listener,
+                           surface);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+  }
+
+  memcpy(surface->data, surface->contents, size);
+  wl_surface_attach(surface->surface, surface->buffer, 0, 0);
+  wl_surface_damage(surface->surface, 0, 0, surface->width, surface->height);
+  wl_surface_commit(surface->surface);
+  surface->busy = 1;
+  surface->dirty = 0;
+}
+
+static void receiver_xdg_surface_configure(void* data,
+                                           struct zxdg_surface_v6* xdg_surface,
+                                           uint32_t serial) {
+  struct receiver_surface* surface = (struct receiver_surface*)data;
+
+  zxdg_surface_v6_ack_configure(xdg_surface, serial);
+  surface->configured = 1;
+  receiver_surface_present(surface);
+}
+
+static const struct zxdg_surface_v6_listener receiver_xdg_surface_listener = {
+    receiver_xdg_surface_configure};
+
+static void receiver_toplevel_configure(void* data,
+                                        struct zxdg_toplevel_v6* toplevel,
+                                        int32_t width,
+                                        int32_t height,
+                                        struct wl_array* states) {}
+
+static void receiver_toplevel_close(void* data,
+                                    struct zxdg_toplevel_v6* toplevel) {}
+
+static const struct zxdg_toplevel_v6_listener receiver_toplevel_listener = {
+    receiver_toplevel_configure, receiver_toplevel_close};
+
+static void receiver_surface_destroy_buffer(struct receiver_surface* surface) {
+  if (!surface->buffer)
+    return;
+
+  wl_buffer_destroy(surface->buffer);
+  munmap(surface->data, surface->width * surface->height * 4);
+  surface->buffer = NULL;
+  surface->busy = 0;
+}
+
+static struct receiver_surface* receiver_surface_get(struct receiver* receiver,
+                                                     uint32_t id) {
+  struct receiver_surface* surface;
+  char title[32];
+
+  for (surface = receiver->surfaces; surface; surface = surface->next) {
+    if (surface->id == id)
+      return surface;
+  }
+
+  surface = calloc(1, sizeof(*surface));
+  if (!surface) {
+    fprintf(stderr, "error: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  surface->receiver = receiver;
+  surface->id = id;
+  surface->surface = wl_compositor_create_surface(receiver->compositor);
+  surface->xdg_surface =
+      zxdg_shell_v6_get_xdg_surface(receiver->xdg_shell, surface->surface);
+  zxdg_surface_v6_add_listener(surface->xdg_surface,
+                               &receiver_xdg_surface_listener, surface);
+  surface->toplevel = zxdg_surface_v6_get_toplevel(surface->xdg_surface);
+  zxdg_toplevel_v6_add_listener(surface->toplevel,
+                                &receiver_toplevel_listener, surface);
+  snprintf(title, sizeof(title), "sommelier surface %u", id);
+  zxdg_toplevel_v6_set_title(surface->toplevel, title);
+  wl_surface_commit(surface->surface);
+
+  surface->next = receiver->surfaces;
+  receiver->surfaces = surface;
+  return surface;
+}
+
+static void receiver_commit(void* data,
+                            uint32_t surface_id,
+                            struct sl_stream_received_buffer* buffer) {
+  struct receiver* receiver = (struct receiver*)data;
+  struct sl_stream_buffer_create* info = &buffer->info;
+  struct receiver_surface* surface;
+  size_t y;
+
+  // Only single plane 32 bit formats are presented.
+  if (info->format != WL_SHM_FORMAT_ARGB8888 &&
+      info->format != WL_SHM_FORMAT_XRGB8888) {
+    return;
+  }
+
+  surface = receiver_surface_get(receiver, surface_id);
+  if (surface->width != info->width || surface->height != info->height ||
+      surface->format != info->format) {
+    receiver_surface_destroy_buffer(surface);
+    free(surface->contents);
+    surface->width = info->width;
+    surface->height = info->height;
+    surface->format = info->format;
+    surface->contents = malloc(info->width * info->height * 4);
+    if (!surface->contents) {
+      fprintf(stderr, "error: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (y = 0; y < info->height; ++y) {
+    memcpy(surface->contents + y * info->width * 4,
+           buffer->data + info->offset[0] + y * info->stride[0],
+           info->width * 4);
+  }
+  surface->dirty = 1;
+  receiver_surface_present(surface);
+}
+
+static void receiver_xdg_shell_ping(void* data,
+                                    struct zxdg_shell_v6* xdg_shell,
+                                    uint32_t serial) {
+  zxdg_shell_v6_pong(xdg_shell, serial);
+}
+
+static const struct zxdg_shell_v6_listener receiver_xdg_shell_listener = {
+    receiver_xdg_shell_ping};
+
+static void receiver_registry_global(void* data,
+                                     struct wl_registry* registry,
+                                     uint32_t id,
+                                     const char* interface,
+                                     uint32_t version) {
+  struct receiver* receiver = (struct receiver*)data;
+
+  if (strcmp(interface, "wl_compositor") == 0) {
+    receiver->compositor =
+        wl_registry_bind(registry, id, &wl_compositor_interface, 1);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    receiver->shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
+  } else if (strcmp(interface, "zxdg_shell_v6") == 0) {
+    receiver->xdg_shell =
+        wl_registry_bind(registry, id, &zxdg_shell_v6_interface, 1);
+    zxdg_shell_v6_add_listener(receiver->xdg_shell,
+                               &receiver_xdg_shell_listener, receiver);
+  }
+}
+
+static void receiver_registry_global_remove(void* data,
+                                            struct wl_registry* registry,
+                                            uint32_t id) {}
+
+static const struct wl_registry_listener receiver_registry_listener = {
+    receiver_registry_global, receiver_registry_global_remove};
+
+int main(int argc, char** argv) {
+  struct receiver receiver = {0};
+  struct sl_stream_receiver stream;
+  int fd = argc > 1 ? atoi(argv[1]) : STDIN_FILENO;
+  int rv = 1;
+
+  receiver.display = wl_display_connect(NULL);
+  if (!receiver.display) {
+    fprintf(stderr, "error: failed to connect to display\n");
+    return EXIT_FAILURE;
+  }
+  wl_registry_add_listener(wl_display_get_registry(receiver.display),
+                           &receiver_registry_listener, &receiver);
+  wl_display_roundtrip(receiver.display);
+  if (!receiver.compositor || !receiver.shm || !receiver.xdg_shell) {
+    fprintf(stderr, "error: compositor lacks required globals\n");
+    return EXIT_FAILURE;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  sl_stream_receiver_init(&stream, fd, receiver_commit, &receiver);
+
+  while (rv > 0) {
+    struct pollfd fds[] = {
+        {wl_display_get_fd(receiver.display), POLLIN, 0},
+        {fd, POLLIN, 0},
+    };
+
+    wl_display_flush(receiver.display);
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if (wl_display_dispatch(receiver.display) < 0)
+        break;
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP))
+      rv = sl_stream_receiver_dispatch(&stream);
+  }
+
+  sl_stream_receiver_fini(&stream);
+  wl_display_disconnect(receiver.display);
+  return rv < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -13,17 +13,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
 
 #include "drm-server-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "viewporter-client-protocol.h"
 
 #define MIN_SIZE (INT_MIN / 10)
 #define MAX_SIZE (INT_MAX / 10)
 
+#define STAGING_BLOCK_MIN_SIZE (1024 * 1024)
+#define STAGING_BLOCK_MAX_SIZE (32 * 1024 * 1024)
+#define STAGING_MIN_ALIGNMENT 4096
+
+// Host frame callbacks that haven't arrived after this long are considered
+// lost, as hosts don't send them for surfaces that are hidden.
+#define PACING_TIMEOUT_MS 100
+
+// Time before the predicted host repaint that held commits are forwarded
+// at, which leaves the host time to composite them.
+#define PACING_DEADLINE_MARGIN_US 4000
+
 #define DMA_BUF_SYNC_READ (1 << 0)
 #define DMA_BUF_SYNC_WRITE (2 << 0)
 #define DMA_BUF_SYNC_RW (DMA_BUF_SYNC_READ | DMA_BUF_SYNC_WRITE)
@@ -48,8 +62,29 @@ struct sl_output_buffer {
   struct sl_mmap* mmap;
   struct pixman_region32 damage;
   struct sl_host_surface* surface;
+  struct sl_staging_block* block;
+  size_t block_offset;
+  size_t block_size;
+  struct wl_list block_link;
+  uint32_t stream_id;
+  int stream_synced;
+};
+
+// Large virtwl allocation shared with the host as a long-lived pool that
+// output buffers of the virtwl driver are carved out of.
+struct sl_staging_block {
+  struct wl_list link;
+  struct wl_list buffers;
+  struct wl_shm_pool* pool;
+  int fd;
+  size_t size;
+  size_t used;
 };
 
+static struct sl_slab sl_output_buffer_slab =
+    SL_SLAB_INIT(struct sl_output_buffer);
+static struct sl_slab sl_host_region_slab = SL_SLAB_INIT(struct sl_host_region);
+
 struct dma_buf_sync {
   __u64 flags;
 };
@@ -64,11 +99,11 @@ static void sl_dmabuf_sync(int fd, __u64 flags) {
   } while (rv == -1 && errno == EINTR);
 }
 
-static void sl_dmabuf_begin_write(int fd) {
+void sl_dmabuf_begin_write(int fd) {
   sl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
 }
 
-static void sl_dmabuf_end_write(int fd) {
+void sl_dmabuf_end_write(int fd) {
   sl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
 }
 
@@ -82,11 +117,11 @@ static void sl_virtwl_dmabuf_sync(int fd, __u32 flags) {
   UNUSED(rv);
 }
 
-static void sl_virtwl_dmabuf_begin_write(int fd) {
+void sl_virtwl_dmabuf_begin_write(int fd) {
   sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
 }
 
-static void sl_virtwl_dmabuf_end_write(int fd) {
+void sl_virtwl_dmabuf_end_write(int fd) {
   sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
 }
 
@@ -128,25 +163,247 @@ static uint32_t sl_drm_format_for_shm_format(int format) {
   return 0;
 }
 
+static struct sl_staging_block* sl_staging_block_create(struct sl_context* ctx,
+                                                        size_t size) {
+  struct virtwl_ioctl_new ioctl_new = {
+      .type = VIRTWL_IOCTL_NEW_ALLOC, .fd = -1, .flags = 0, .size = size};
+  struct sl_staging_block* block;
+  int rv;
+
+  rv = ioctl(ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+  assert(rv == 0);
+  UNUSED(rv);
+
+  block = malloc(sizeof(*block));
+  assert(block);
+  wl_list_init(&block->buffers);
+  block->fd = ioctl_new.fd;
+  block->size = size;
+  block->used = 0;
+  block->pool = wl_shm_create_pool(ctx->shm->internal, block->fd, size);
+  wl_list_insert(&ctx->staging_blocks, &block->link);
+
+  return block;
+}
+
+static void sl_staging_assign(struct sl_staging_block* block,
+                              struct sl_output_buffer* buffer,
+                              struct wl_list* prev,
+                              size_t offset,
+                              size_t size) {
+  buffer->block = block;
+  buffer->block_offset = offset;
+  buffer->block_size = size;
+  wl_list_insert(prev, &buffer->block_link);
+  block->used += size;
+}
+
+// Buffers are mapped at their offset into a block, so offsets have to be
+// multiples of the page size, which is larger than 4KiB on some kernels.
+static size_t sl_staging_alignment(void) {
+  static size_t alignment;
+
+  if (!alignment) {
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    alignment = MAX(page_size > 0 ? (size_t)page_size : 0,
+                    (size_t)STAGING_MIN_ALIGNMENT);
+  }
+
+  return alignment;
+}
+
+// Assigns a range of a staging block to |buffer| using first-fit, creating
+// a new block if none of the existing ones has a large enough gap.
+static void sl_staging_alloc(struct sl_context* ctx,
+                             struct sl_output_buffer* buffer,
+                             size_t size) {
+  struct sl_staging_block* block;
+  struct sl_output_buffer* other;
+  size_t alignment = sl_staging_alignment();
+  size_t total = 0;
+
+  size = (size + alignment - 1) & ~(alignment - 1);
+
+  wl_list_for_each(block, &ctx->staging_blocks, link) {
+    struct wl_list* prev = &block->buffers;
+    size_t offset = 0;
+
+    total += block->size;
+    if (block->size - block->used < size)
+      continue;
+
+    // Buffers are kept sorted by offset.
+    wl_list_for_each(other, &block->buffers, block_link) {
+      if (other->block_offset - offset >= size)
+        break;
+      offset = other->block_offset + other->block_size;
+      prev = &other->block_link;
+    }
+
+    if (block->size - offset >= size) {
+      sl_staging_assign(block, buffer, prev, offset, size);
+      return;
+    }
+  }
+
+  // Empty blocks are kept until the next trim and reused if large enough.
+  wl_list_for_each(block, &ctx->empty_staging_blocks, link) {
+    if (block->size >= size) {
+      wl_list_remove(&block->link);
+      wl_list_insert(&ctx->staging_blocks, &block->link);
+      sl_staging_assign(block, buffer, &block->buffers, 0, size);
+      return;
+    }
+  }
+
+  // Blocks grow with the total size of blocks in use, so a few small buffers
+  // only reserve what they need while many buffers still share few pools.
+  total = MIN(MAX(total, STAGING_BLOCK_MIN_SIZE), STAGING_BLOCK_MAX_SIZE);
+  block = sl_staging_block_create(ctx, MAX(size, total));
+  sl_staging_assign(block, buffer, &block->buffers, 0, size);
+}
+
+static void sl_staging_free(struct sl_context* ctx,
+                            struct sl_output_buffer* buffer) {
+  struct sl_staging_block* block = buffer->block;
+
+  wl_list_remove(&buffer->block_link);
+  block->used -= buffer->block_size;
+  if (wl_list_empty(&block->buffers)) {
+    wl_list_remove(&block->link);
+    wl_list_insert(&ctx->empty_staging_blocks, &block->link);
+  }
+}
+
+size_t sl_staging_trim(struct sl_context* ctx) {
+  struct sl_staging_block *block, *next;
+  size_t bytes = 0;
+
+  // Live buffers may be in use by the host and can't be moved, so only
+  // blocks that have become empty are returned.
+  wl_list_for_each_safe(block, next, &ctx->empty_staging_blocks, link) {
+    bytes += block->size;
+    wl_shm_pool_destroy(block->pool);
+    close(block->fd);
+    wl_list_remove(&block->link);
+    free(block);
+  }
+
+  return bytes;
+}
+
 static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
-  wl_buffer_destroy(buffer->internal);
+  struct sl_context* ctx = buffer->surface->ctx;
+
+  if (buffer->stream_id && ctx->stream.fd >= 0)
+    sl_stream_buffer_destroy(ctx, buffer->stream_id);
+  if (buffer->internal)
+    wl_buffer_destroy(buffer->internal);
+  if (buffer->block)
+    sl_staging_free(ctx, buffer);
+  ctx->stats.buffer_count--;
+  ctx->stats.buffer_bytes -= sl_mmap_length(buffer->mmap);
   sl_mmap_unref(buffer->mmap);
   pixman_region32_fini(&buffer->damage);
   wl_list_remove(&buffer->link);
-  free(buffer);
+  sl_slab_free(&sl_output_buffer_slab, buffer);
 }
 
-static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
-  struct sl_output_buffer* output_buffer = wl_buffer_get_user_data(buffer);
-  struct sl_host_surface* host_surface = output_buffer->surface;
+// Moves |buffer| to the released list, or destroys it if the surface keeps
+// more intermediate buffers than its profile allows.
+static void sl_output_buffer_released(struct sl_output_buffer* buffer) {
+  struct sl_host_surface* host = buffer->surface;
+
+  wl_list_remove(&buffer->link);
+  wl_list_insert(&host->released_buffers, &buffer->link);
 
-  wl_list_remove(&output_buffer->link);
-  wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
+  if (host->queue_depth && buffer != host->current_buffer &&
+      buffer != host->pending_copy.buffer &&
+      wl_list_length(&host->released_buffers) +
+              wl_list_length(&host->busy_buffers) >
+          host->queue_depth) {
+    sl_output_buffer_destroy(buffer);
+  }
+}
+
+static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
+  sl_output_buffer_released(wl_buffer_get_user_data(buffer));
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
     sl_output_buffer_release};
 
+size_t sl_host_surface_release_buffers(struct sl_host_surface* host) {
+  struct sl_output_buffer *buffer, *next;
+  size_t bytes = 0;
+
+  // Released buffers are not used by the host. The current buffer is on the
+  // released list between attach and commit, and the host can release the
+  // target of a pending copy before the copy is resolved, so both have to
+  // be kept.
+  wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+    if (buffer != host->current_buffer &&
+        buffer != host->pending_copy.buffer) {
+      bytes += sl_mmap_length(buffer->mmap);
+      sl_output_buffer_destroy(buffer);
+    }
+  }
+
+  return bytes;
+}
+
+// Releases buffers that the host is done with from staging blocks that are
+// less than half full, so that those blocks can empty out and be trimmed.
+// Surfaces allocate replacements first-fit into the remaining blocks.
+static void sl_staging_compact(struct sl_context* ctx) {
+  struct sl_output_buffer *buffer, *next;
+  struct sl_host_surface* host;
+
+  if (wl_list_length(&ctx->staging_blocks) < 2)
+    return;
+
+  wl_list_for_each(host, &ctx->surfaces, link) {
+    wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+      if (buffer != host->current_buffer &&
+          buffer != host->pending_copy.buffer && buffer->block &&
+          buffer->block->used * 2 < buffer->block->size) {
+        sl_output_buffer_destroy(buffer);
+      }
+    }
+  }
+}
+
+static int sl_handle_idle_trim_timer(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_host_surface* host;
+
+  // Surfaces that have not committed since the last time the timer fired
+  // are considered idle.
+  wl_list_for_each(host, &ctx->surfaces, link) {
+    if (host->idle && host->idle_trim)
+      sl_host_surface_release_buffers(host);
+    host->idle = 1;
+  }
+  sl_staging_compact(ctx);
+  sl_staging_trim(ctx);
+  sl_slab_trim();
+
+  wl_event_source_timer_update(ctx->idle_trim_event_source,
+                               ctx->idle_trim_timeout * 1000);
+  return 0;
+}
+
+void sl_idle_trim_init(struct sl_context* ctx) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+
+  ctx->idle_trim_event_source =
+      wl_event_loop_add_timer(event_loop, sl_handle_idle_trim_timer, ctx);
+  wl_event_source_timer_update(ctx->idle_trim_event_source,
+                               ctx->idle_trim_timeout * 1000);
+}
+
 static void sl_host_surface_destroy(struct wl_client* client,
                                     struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -164,12 +421,21 @@ static void sl_host_surface_attach(struct wl_client* client,
   struct sl_window* window;
   double scale = host->ctx->scale;
 
+  // A buffer attached by commits that were held never reaches the host, so
+  // the host won't release it once this attach replaces it.
+  if (host->pending_buffer) {
+    wl_list_remove(&host->pending_buffer->link);
+    wl_list_insert(&host->released_buffers, &host->pending_buffer->link);
+    host->pending_buffer = NULL;
+  }
+
   host->current_buffer = NULL;
   if (host->contents_shm_mmap) {
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
   }
 
+  host->buffer_attached = host_buffer != NULL;
   if (host_buffer) {
     host->contents_width = host_buffer->width;
     host->contents_height = host_buffer->height;
@@ -179,18 +445,21 @@ static void sl_host_surface_attach(struct wl_client* client,
   }
 
   if (host->contents_shm_mmap) {
-    while (!wl_list_empty(&host->released_buffers)) {
-      host->current_buffer = wl_container_of(host->released_buffers.next,
-                                             host->current_buffer, link);
-
-      if (host->current_buffer->width == host_buffer->width &&
-          host->current_buffer->height == host_buffer->height &&
-          host->current_buffer->format == host_buffer->shm_format) {
+    struct sl_output_buffer* output_buffer;
+    struct sl_output_buffer* next;
+
+    // The target of a pending copy is kept until the copy is resolved.
+    wl_list_for_each_safe(output_buffer, next, &host->released_buffers,
+                          link) {
+      if (output_buffer->width == host_buffer->width &&
+          output_buffer->height == host_buffer->height &&
+          output_buffer->format == host_buffer->shm_format) {
+        host->current_buffer = output_buffer;
         break;
       }
 
-      sl_output_buffer_destroy(host->current_buffer);
-      host->current_buffer = NULL;
+      if (output_buffer != host->pending_copy.buffer)
+        sl_output_buffer_destroy(output_buffer);
     }
 
     // Allocate new output buffer.
@@ -201,28 +470,37 @@ static void sl_host_surface_attach(struct wl_client* client,
       size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
       size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
 
-      host->current_buffer = malloc(sizeof(struct sl_output_buffer));
-      assert(host->current_buffer);
+      host->current_buffer = sl_slab_alloc(&sl_output_buffer_slab);
       wl_list_insert(&host->released_buffers, &host->current_buffer->link);
       host->current_buffer->width = width;
       host->current_buffer->height = height;
       host->current_buffer->format = shm_format;
       host->current_buffer->surface = host;
+      host->current_buffer->block = NULL;
       pixman_region32_init_rect(&host->current_buffer->damage, 0, 0, MAX_SIZE,
                                 MAX_SIZE);
 
       switch (host->ctx->shm_driver) {
         case SHM_DRIVER_DMABUF: {
           struct zwp_linux_buffer_params_v1* buffer_params;
-          struct gbm_bo* bo;
-          int stride0;
+          struct gbm_bo* bo = NULL;
+          size_t stride0;
           int fd;
 
-          bo = gbm_bo_create(host->ctx->gbm, width, height,
-                             sl_gbm_format_for_shm_format(shm_format),
-                             GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
-          stride0 = gbm_bo_get_stride(bo);
-          fd = gbm_bo_get_fd(bo);
+          if (host->ctx->gbm) {
+            bo = gbm_bo_create(host->ctx->gbm, width, height,
+                               sl_gbm_format_for_shm_format(shm_format),
+                               GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+            stride0 = gbm_bo_get_stride(bo);
+            fd = gbm_bo_get_fd(bo);
+          } else {
+            fd = sl_dma_heap_alloc(host->ctx, width, height, bpp, &stride0);
+            if (fd == -1) {
+              fprintf(stderr, "error: dma heap allocation failed: %s\n",
+                      strerror(errno));
+              _exit(EXIT_FAILURE);
+            }
+          }
 
           buffer_params = zwp_linux_dmabuf_v1_create_params(
               host->ctx->linux_dmabuf->internal);
@@ -239,31 +517,46 @@ static void sl_host_surface_attach(struct wl_client* client,
           host->current_buffer->mmap->begin_write = sl_dmabuf_begin_write;
           host->current_buffer->mmap->end_write = sl_dmabuf_end_write;
 
-          gbm_bo_destroy(bo);
+          if (bo)
+            gbm_bo_destroy(bo);
         } break;
         case SHM_DRIVER_VIRTWL: {
           size_t size = host_buffer->shm_mmap->size;
-          struct virtwl_ioctl_new ioctl_new = {.type = VIRTWL_IOCTL_NEW_ALLOC,
-                                               .fd = -1,
-                                               .flags = 0,
-                                               .size = size};
-          struct wl_shm_pool* pool;
-          int rv;
+          size_t offset;
 
-          rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
-          assert(rv == 0);
-          UNUSED(rv);
+          sl_staging_alloc(host->ctx, host->current_buffer, size);
+          offset = host->current_buffer->block_offset;
 
-          pool =
-              wl_shm_create_pool(host->ctx->shm->internal, ioctl_new.fd, size);
           host->current_buffer->internal = wl_shm_pool_create_buffer(
-              pool, 0, width, height, host_buffer->shm_mmap->stride[0],
-              shm_format);
-          wl_shm_pool_destroy(pool);
+              host->current_buffer->block->pool, offset, width, height,
+              host_buffer->shm_mmap->stride[0], shm_format);
+
+          // Only the range of the block that belongs to this buffer is
+          // mapped.
+          host->current_buffer->mmap = sl_mmap_create_at(
+              dup(host->current_buffer->block->fd), offset, size, bpp,
+              num_planes, 0, host_buffer->shm_mmap->stride[0],
+              host_buffer->shm_mmap->offset[1] -
+                  host_buffer->shm_mmap->offset[0],
+              host_buffer->shm_mmap->stride[1], host_buffer->shm_mmap->y_ss[0],
+              host_buffer->shm_mmap->y_ss[1]);
+        } break;
+        case SHM_DRIVER_STREAM: {
+          size_t size = host_buffer->shm_mmap->size;
+          int fd;
+
+          // Contents only reach the host through the damage stream, so the
+          // buffer is private and just holds what the receiver has seen.
+          fd = memfd_create("sommelier-stream", MFD_CLOEXEC);
+          if (fd == -1 || ftruncate(fd, size)) {
+            fprintf(stderr, "error: stream buffer allocation failed: %s\n",
+                    strerror(errno));
+            _exit(EXIT_FAILURE);
+          }
 
+          host->current_buffer->internal = NULL;
           host->current_buffer->mmap = sl_mmap_create(
-              ioctl_new.fd, size, bpp, num_planes, 0,
-              host_buffer->shm_mmap->stride[0],
+              fd, size, bpp, num_planes, 0, host_buffer->shm_mmap->stride[0],
               host_buffer->shm_mmap->offset[1] -
                   host_buffer->shm_mmap->offset[0],
               host_buffer->shm_mmap->stride[1], host_buffer->shm_mmap->y_ss[0],
@@ -318,13 +611,28 @@ static void sl_host_surface_attach(struct wl_client* client,
         } break;
       }
 
-      assert(host->current_buffer->internal);
+      assert(host->current_buffer->internal ||
+             host->ctx->shm_driver == SHM_DRIVER_STREAM);
       assert(host->current_buffer->mmap);
 
-      wl_buffer_set_user_data(host->current_buffer->internal,
-                              host->current_buffer);
-      wl_buffer_add_listener(host->current_buffer->internal,
-                             &sl_output_buffer_listener, host->current_buffer);
+      host->ctx->stats.buffer_count++;
+      host->ctx->stats.buffer_bytes +=
+          sl_mmap_length(host->current_buffer->mmap);
+
+      host->current_buffer->stream_id = 0;
+      host->current_buffer->stream_synced = 0;
+      if (host->ctx->stream.fd >= 0) {
+        host->current_buffer->stream_id = sl_stream_buffer_create(
+            host->ctx, width, height, shm_format, host->current_buffer->mmap);
+      }
+
+      if (host->current_buffer->internal) {
+        wl_buffer_set_user_data(host->current_buffer->internal,
+                                host->current_buffer);
+        wl_buffer_add_listener(host->current_buffer->internal,
+                               &sl_output_buffer_listener,
+                               host->current_buffer);
+      }
     }
   }
 
@@ -337,10 +645,15 @@ static void sl_host_surface_attach(struct wl_client* client,
   }
 
   if (host->current_buffer) {
-    assert(host->current_buffer->internal);
-    wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
+    // Stream buffers are presented by the receiver, so nothing is attached
+    // on the host.
+    if (host->current_buffer->internal) {
+      wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
+      host->pending_buffer = host->current_buffer;
+    }
   } else {
     wl_surface_attach(host->proxy, buffer_proxy, x, y);
+    host->forwarded_attach = buffer_proxy != NULL;
   }
 
   wl_list_for_each(window, &host->ctx->windows, link) {
@@ -400,12 +713,25 @@ static void sl_frame_callback_done(void* data,
 static const struct wl_callback_listener sl_frame_callback_listener = {
     sl_frame_callback_done};
 
+// Done for callbacks of surfaces that are only presented by a stream
+// receiver, once the contents of their commit have been written.
+static void sl_stream_frame_callback_done(struct sl_stream_waiter* waiter) {
+  struct sl_host_callback* host =
+      wl_container_of(waiter, host, stream_waiter);
+
+  wl_callback_send_done(host->resource, sl_now_us() / 1000);
+  wl_resource_destroy(host->resource);
+}
+
 static void sl_host_callback_destroy(struct wl_resource* resource) {
   struct sl_host_callback* host = wl_resource_get_user_data(resource);
 
-  wl_callback_destroy(host->proxy);
+  if (host->proxy)
+    wl_callback_destroy(host->proxy);
+  else
+    wl_list_remove(&host->stream_waiter.link);
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_slab_free(&sl_host_callback_slab, host);
 }
 
 static void sl_host_surface_frame(struct wl_client* client,
@@ -414,13 +740,24 @@ static void sl_host_surface_frame(struct wl_client* client,
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_callback* host_callback;
 
-  host_callback = malloc(sizeof(*host_callback));
-  assert(host_callback);
+  host_callback = sl_slab_alloc(&sl_host_callback_slab);
 
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
   wl_resource_set_implementation(host_callback->resource, NULL, host_callback,
                                  sl_host_callback_destroy);
+
+  // Nothing is attached to host surfaces with the stream driver, so the
+  // host never sends frame callbacks for them. Callbacks are done once the
+  // next commit has been written to the stream instead.
+  if (host->ctx->shm_driver == SHM_DRIVER_STREAM) {
+    host_callback->proxy = NULL;
+    host_callback->stream_waiter.done = sl_stream_frame_callback_done;
+    wl_list_insert(host->stream_frame_callbacks.prev,
+                   &host_callback->stream_waiter.link);
+    return;
+  }
+
   host_callback->proxy = wl_surface_frame(host->proxy);
   wl_callback_set_user_data(host_callback->proxy, host_callback);
   wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
@@ -451,106 +788,586 @@ static void sl_host_surface_set_input_region(
                               host_region ? host_region->proxy : NULL);
 }
 
-static void sl_host_surface_commit(struct wl_client* client,
-                                   struct wl_resource* resource) {
-  struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  struct sl_viewport* viewport = NULL;
-  struct sl_window* window;
-
-  if (!wl_list_empty(&host->contents_viewport))
-    viewport = wl_container_of(host->contents_viewport.next, viewport, link);
+// Compares the visible area of the intermediate buffer against the client's
+// buffer after damage has been copied. A mismatch means damage was lost by
+// the copy path, so details about the copy are reported along with the
+// bounds of the mismatch.
+static void sl_host_surface_verify_copy(struct sl_host_surface* host,
+                                        struct sl_surface_copy* copy) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_output_buffer* buffer = copy->buffer;
+  struct sl_viewport* viewport = copy->has_viewport ? &copy->viewport : NULL;
+  struct sl_mmap* src_map = copy->shm_mmap;
+  struct sl_mmap* dst_map = buffer->mmap;
+  size_t x0 = 0, y0 = 0;
+  size_t width = copy->width;
+  size_t height = copy->height;
+  size_t row_bytes;
+  size_t i;
+
+  // Contents outside of the viewport source rectangle are not visible and
+  // damage to them is never copied.
+  if (viewport && viewport->src_x >= 0 && viewport->src_y >= 0 &&
+      viewport->src_width >= 0 && viewport->src_height >= 0) {
+    x0 = MIN(wl_fixed_to_int(viewport->src_x), width);
+    y0 = MIN(wl_fixed_to_int(viewport->src_y), height);
+    width = MIN(wl_fixed_to_int(viewport->src_width), width - x0);
+    height = MIN(wl_fixed_to_int(viewport->src_height), height - y0);
+  }
+  row_bytes = width * src_map->bpp;
+  if (!row_bytes)
+    return;
+
+  for (i = 0; i < src_map->num_planes; ++i) {
+    uint8_t* src = (uint8_t*)src_map->addr + src_map->offset[i] +
+                   x0 * src_map->bpp;
+    uint8_t* dst = (uint8_t*)dst_map->addr + dst_map->offset[i] +
+                   x0 * src_map->bpp;
+    size_t rows = (y0 + height) / src_map->y_ss[i];
+    size_t x1 = row_bytes, x2 = 0, y1 = rows, y2 = 0;
+    size_t y;
+
+    for (y = y0 / src_map->y_ss[i]; y < rows; ++y) {
+      uint8_t* s = src + y * src_map->stride[i];
+      uint8_t* d = dst + y * dst_map->stride[i];
+      size_t first = 0, last = row_bytes;
+
+      if (!memcmp(s, d, row_bytes))
+        continue;
 
-  if (host->contents_shm_mmap) {
-    uint8_t* src_addr = host->contents_shm_mmap->addr;
-    uint8_t* dst_addr = host->current_buffer->mmap->addr;
-    size_t* src_offset = host->contents_shm_mmap->offset;
-    size_t* dst_offset = host->current_buffer->mmap->offset;
-    size_t* src_stride = host->contents_shm_mmap->stride;
-    size_t* dst_stride = host->current_buffer->mmap->stride;
-    size_t* y_ss = host->contents_shm_mmap->y_ss;
-    size_t bpp = host->contents_shm_mmap->bpp;
-    size_t num_planes = host->contents_shm_mmap->num_planes;
-    double contents_scale_x = host->contents_scale;
-    double contents_scale_y = host->contents_scale;
-    double contents_offset_x = 0.0;
-    double contents_offset_y = 0.0;
-    pixman_box32_t* rect;
-    int n;
-
-    // Determine scale and offset for damage based on current viewport.
-    if (viewport) {
-      double contents_width = host->contents_width;
-      double contents_height = host->contents_height;
-
-      if (viewport->src_x >= 0 && viewport->src_y >= 0) {
-        contents_offset_x = wl_fixed_to_double(viewport->src_x);
-        contents_offset_y = wl_fixed_to_double(viewport->src_y);
+      while (s[first] == d[first])
+        ++first;
+      while (s[last - 1] == d[last - 1])
+        --last;
+      x1 = MIN(x1, first);
+      x2 = MAX(x2, last);
+      y1 = MIN(y1, y);
+      y2 = y + 1;
+
+      // Repaired rows are sent to the stream as well, as the receiver
+      // applies later damage on top of them.
+      if (ctx->verify_copy_fallback) {
+        if (buffer->stream_id && ctx->stream.fd >= 0 &&
+            buffer->stream_synced) {
+          sl_stream_damage(ctx, buffer->stream_id, dst_map->addr, d,
+                           dst_map->stride[i], s, src_map->stride[i],
+                           row_bytes, 1, !dst_map->begin_write);
+        }
+        memcpy(d, s, row_bytes);
       }
+    }
 
-      if (viewport->dst_width > 0 && viewport->dst_height > 0) {
-        contents_scale_x *= contents_width / viewport->dst_width;
-        contents_scale_y *= contents_height / viewport->dst_height;
-
-        // Take source rectangle into account when both destionation size and
-        // source rectangle are set. If only source rectangle is set, then
-        // it determines the surface size so it can be ignored.
-        if (viewport->src_width >= 0 && viewport->src_height >= 0) {
-          contents_scale_x *=
-              wl_fixed_to_double(viewport->src_width) / contents_width;
-          contents_scale_y *=
-              wl_fixed_to_double(viewport->src_height) / contents_height;
-        }
+    if (y1 >= y2)
+      continue;
+
+    fprintf(stderr,
+            "error: copy mismatch on surface %u plane %zu at %zu,%zu %zux%zu "
+            "(driver=%s staging=%d hybrid=%d stream=%d)\n",
+            host->id, i, x0 + x1 / src_map->bpp, y1,
+            (x2 - x1 + src_map->bpp - 1) / src_map->bpp, y2 - y1,
+            sl_shm_driver_name(ctx->shm_driver), buffer->block != NULL,
+            ctx->shm_hybrid, buffer->stream_id != 0);
+
+    // Mismatched rows have been copied in full above. Later commits copy
+    // the whole buffer rather than relying on damage.
+    if (ctx->verify_copy_fallback)
+      host->copy_full = 1;
+  }
+}
+
+// Copies damaged contents of a commit into its intermediate buffer.
+static void sl_host_surface_copy(struct sl_host_surface* host,
+                                 struct sl_surface_copy* copy) {
+  struct sl_output_buffer* buffer = copy->buffer;
+  struct sl_viewport* viewport = copy->has_viewport ? &copy->viewport : NULL;
+  uint8_t* src_addr = copy->shm_mmap->addr;
+  uint8_t* dst_addr = buffer->mmap->addr;
+  size_t* src_offset = copy->shm_mmap->offset;
+  size_t* dst_offset = buffer->mmap->offset;
+  size_t* src_stride = copy->shm_mmap->stride;
+  size_t* dst_stride = buffer->mmap->stride;
+  size_t* y_ss = copy->shm_mmap->y_ss;
+  size_t bpp = copy->shm_mmap->bpp;
+  size_t num_planes = copy->shm_mmap->num_planes;
+  double contents_scale_x = copy->scale;
+  double contents_scale_y = copy->scale;
+  double contents_offset_x = 0.0;
+  double contents_offset_y = 0.0;
+  pixman_box32_t* rect;
+  int stream = buffer->stream_id && host->ctx->stream.fd >= 0;
+  int copy_stage = buffer->mmap->begin_write ? SL_PERF_STAGE_COPY_DMABUF
+                                             : SL_PERF_STAGE_COPY_SHM;
+  uint64_t perf_start[SL_PERF_COUNTERS];
+  int n;
+
+  // Determine scale and offset for damage based on current viewport.
+  if (viewport) {
+    double contents_width = copy->width;
+    double contents_height = copy->height;
+
+    if (viewport->src_x >= 0 && viewport->src_y >= 0) {
+      contents_offset_x = wl_fixed_to_double(viewport->src_x);
+      contents_offset_y = wl_fixed_to_double(viewport->src_y);
+    }
+
+    if (viewport->dst_width > 0 && viewport->dst_height > 0) {
+      contents_scale_x *= contents_width / viewport->dst_width;
+      contents_scale_y *= contents_height / viewport->dst_height;
+
+      // Take source rectangle into account when both destionation size and
+      // source rectangle are set. If only source rectangle is set, then
+      // it determines the surface size so it can be ignored.
+      if (viewport->src_width >= 0 && viewport->src_height >= 0) {
+        contents_scale_x *=
+            wl_fixed_to_double(viewport->src_width) / contents_width;
+        contents_scale_y *=
+            wl_fixed_to_double(viewport->src_height) / contents_height;
       }
     }
+  }
 
-    if (host->current_buffer->mmap->begin_write)
-      host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd);
-
-    rect = pixman_region32_rectangles(&host->current_buffer->damage, &n);
-    while (n--) {
-      int32_t x1, y1, x2, y2;
-
-      // Enclosing rect after applying scale and offset.
-      x1 = rect->x1 * contents_scale_x + contents_offset_x;
-      y1 = rect->y1 * contents_scale_y + contents_offset_y;
-      x2 = rect->x2 * contents_scale_x + contents_offset_x + 0.5;
-      y2 = rect->y2 * contents_scale_y + contents_offset_y + 0.5;
-
-      x1 = MAX(0, x1);
-      y1 = MAX(0, y1);
-      x2 = MIN(host->contents_width, x2);
-      y2 = MIN(host->contents_height, y2);
-
-      if (x1 < x2 && y1 < y2) {
-        size_t i;
-
-        for (i = 0; i < num_planes; ++i) {
-          uint8_t* src_base = src_addr + src_offset[i];
-          uint8_t* dst_base = dst_addr + dst_offset[i];
-          uint8_t* src = src_base + y1 * src_stride[i] + x1 * bpp;
-          uint8_t* dst = dst_base + y1 * dst_stride[i] + x1 * bpp;
-          int32_t width = x2 - x1;
-          int32_t height = (y2 - y1) / y_ss[i];
-          size_t bytes = width * bpp;
-
-          while (height--) {
-            memcpy(dst, src, bytes);
-            dst += dst_stride[i];
-            src += src_stride[i];
-          }
+  // Commits are dropped while the receiver is behind, after which the
+  // buffer is sent in full.
+  if (stream && sl_stream_congested(host->ctx)) {
+    stream = 0;
+    buffer->stream_synced = 0;
+  }
+
+  if (buffer->mmap->begin_write)
+    buffer->mmap->begin_write(buffer->mmap->fd);
+
+  if (host->copy_full || (stream && !buffer->stream_synced)) {
+    pixman_region32_union_rect(&buffer->damage, &buffer->damage, 0, 0,
+                               MAX_SIZE, MAX_SIZE);
+  }
+
+  rect = pixman_region32_rectangles(&buffer->damage, &n);
+  while (n--) {
+    int32_t x1, y1, x2, y2;
+
+    // Enclosing rect after applying scale and offset.
+    x1 = rect->x1 * contents_scale_x + contents_offset_x;
+    y1 = rect->y1 * contents_scale_y + contents_offset_y;
+    x2 = rect->x2 * contents_scale_x + contents_offset_x + 0.5;
+    y2 = rect->y2 * contents_scale_y + contents_offset_y + 0.5;
+
+    x1 = MAX(0, x1);
+    y1 = MAX(0, y1);
+    x2 = MIN(copy->width, x2);
+    y2 = MIN(copy->height, y2);
+
+    if (x1 < x2 && y1 < y2) {
+      size_t i;
+
+      for (i = 0; i < num_planes; ++i) {
+        uint8_t* src_base = src_addr + src_offset[i];
+        uint8_t* dst_base = dst_addr + dst_offset[i];
+        uint8_t* src = src_base + y1 * src_stride[i] + x1 * bpp;
+        uint8_t* dst = dst_base + y1 * dst_stride[i] + x1 * bpp;
+        int32_t width = x2 - x1;
+        int32_t height = (y2 - y1) / y_ss[i];
+        size_t bytes = width * bpp;
+        size_t bytes_copied;
+
+        // Reading back from dmabufs is slow, so those are only ever sent
+        // in full. Buffers that the receiver has not seen yet are sent in
+        // full as well.
+        if (stream) {
+          sl_perf_read(host->ctx, perf_start);
+          sl_stream_damage(host->ctx, buffer->stream_id, dst_addr, dst,
+                           dst_stride[i], src, src_stride[i], bytes, height,
+                           buffer->stream_synced && !buffer->mmap->begin_write);
+          sl_perf_add(host->ctx, SL_PERF_STAGE_STREAM, perf_start,
+                      bytes * height, NULL);
+        }
+
+        sl_perf_read(host->ctx, perf_start);
+        bytes_copied = bytes * height;
+        while (height--) {
+          memcpy(dst, src, bytes);
+          dst += dst_stride[i];
+          src += src_stride[i];
         }
+        sl_perf_add(host->ctx, copy_stage, perf_start, bytes_copied,
+                    &host->perf);
       }
+    }
+
+    ++rect;
+  }
+
+  // Verification reads back the intermediate buffer so it has to happen
+  // before access to it ends.
+  if (host->ctx->verify_copy_interval &&
+      !(host->ctx->verify_copy_count++ % host->ctx->verify_copy_interval)) {
+    sl_perf_read(host->ctx, perf_start);
+    sl_host_surface_verify_copy(host, copy);
+    sl_perf_add(host->ctx, SL_PERF_STAGE_VERIFY, perf_start,
+                copy->shm_mmap->size, NULL);
+  }
+
+  if (buffer->mmap->end_write)
+    buffer->mmap->end_write(buffer->mmap->fd);
+
+  pixman_region32_clear(&buffer->damage);
+
+  if (stream) {
+    sl_stream_commit(host->ctx, host->id, buffer->stream_id);
+    buffer->stream_synced = 1;
+  }
+
+  // The host never uses stream buffers, so they can be reused as soon as
+  // their contents have been written to the stream.
+  if (!buffer->internal)
+    sl_output_buffer_released(buffer);
+}
+
+// Returns the surface whose commit makes state committed to |host| take
+// effect. That is |host| itself unless it is, or is a descendant of, a
+// synchronized subsurface.
+static struct sl_host_surface* sl_host_surface_sync_root(
+    struct sl_host_surface* host) {
+  struct sl_host_surface* root = host;
+  struct sl_host_surface* surface;
 
-      ++rect;
+  for (surface = host; surface->subsurface_parent;
+       surface = surface->subsurface_parent) {
+    if (surface->subsurface_sync)
+      root = surface->subsurface_parent;
+  }
+
+  return root;
+}
+
+static void sl_surface_copy_release(struct sl_surface_copy* copy) {
+  if (copy->shm_mmap->buffer_resource)
+    wl_buffer_send_release(copy->shm_mmap->buffer_resource);
+  sl_mmap_unref(copy->shm_mmap);
+  copy->shm_mmap = NULL;
+  copy->buffer = NULL;
+}
+
+// Subsurfaces with a pending copy, or with descendants that have one, are
+// linked into the pending list of their parent. Commits that make cached
+// state take effect walk these lists instead of all surfaces.
+void sl_host_surface_link_pending_copy(struct sl_host_surface* host) {
+  struct sl_host_surface* surface;
+
+  if (!host->pending_copy.buffer && wl_list_empty(&host->pending_children))
+    return;
+
+  // Ancestors up to the first one that is already linked are linked as
+  // well, as cached state of the whole subtree takes effect together.
+  for (surface = host;
+       surface->subsurface_parent && wl_list_empty(&surface->pending_link);
+       surface = surface->subsurface_parent) {
+    wl_list_insert(&surface->subsurface_parent->pending_children,
+                   &surface->pending_link);
+  }
+}
+
+void sl_host_surface_discard_pending_copy(struct sl_host_surface* host) {
+  if (host->pending_copy.buffer)
+    sl_surface_copy_release(&host->pending_copy);
+  wl_list_remove(&host->pending_link);
+  wl_list_init(&host->pending_link);
+}
+
+static void sl_host_surface_apply_pending_copies(
+    struct sl_host_surface* host) {
+  while (!wl_list_empty(&host->pending_children)) {
+    struct sl_host_surface* surface =
+        wl_container_of(host->pending_children.next, surface, pending_link);
+
+    wl_list_remove(&surface->pending_link);
+    wl_list_init(&surface->pending_link);
+    if (surface->pending_copy.buffer) {
+      sl_host_surface_copy(surface, &surface->pending_copy);
+      sl_surface_copy_release(&surface->pending_copy);
     }
+    sl_host_surface_apply_pending_copies(surface);
+  }
+}
+
+// Does the copies of |host| and its descendants if cached state of |host|
+// no longer waits for a parent commit, as hosts apply it right away when a
+// subsurface becomes desynchronized.
+void sl_host_surface_resolve_pending_copies(struct sl_host_surface* host) {
+  if (sl_host_surface_sync_root(host) != host)
+    return;
+
+  if (host->pending_copy.buffer) {
+    sl_host_surface_copy(host, &host->pending_copy);
+    sl_surface_copy_release(&host->pending_copy);
+  }
+  sl_host_surface_apply_pending_copies(host);
+}
+
+// Commits are only coalesced when the profile of the surface asks for it,
+// as holding a commit back reorders it against the requests that follow.
+int sl_host_surface_mailbox(struct sl_host_surface* host) {
+  return host->pacing == PACING_MAILBOX;
+}
+
+static struct sl_window* sl_host_surface_window(struct sl_host_surface* host) {
+  struct sl_window* window;
+
+  wl_list_for_each(window, &host->ctx->windows, link) {
+    if (window->host_surface_id == wl_resource_get_id(host->resource))
+      return window;
+  }
 
-    if (host->current_buffer->mmap->end_write)
-      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd);
+  return NULL;
+}
+
+// Host frame callbacks are only requested when something depends on them.
+static int sl_host_surface_paced(struct sl_host_surface* host) {
+  struct sl_window* window;
 
-    pixman_region32_clear(&host->current_buffer->damage);
+  if (sl_host_surface_mailbox(host) || host->ctx->stats.interval)
+    return 1;
+
+  window = sl_host_surface_window(host);
+  return window && window->frame_pending;
+}
+
+// Frames of surfaces that are only presented by a stream receiver end once
+// their commit has been written to the stream.
+static int sl_host_surface_pacing_outstanding(struct sl_host_surface* host) {
+  return host->pacing_callback || !wl_list_empty(&host->pacing_waiter.link);
+}
+
+static void sl_host_surface_cancel_pacing(struct sl_host_surface* host) {
+  if (host->pacing_callback) {
+    wl_callback_destroy(host->pacing_callback);
+    host->pacing_callback = NULL;
+  }
+  wl_list_remove(&host->pacing_waiter.link);
+  wl_list_init(&host->pacing_waiter.link);
+  if (host->pacing_timeout_event_source)
+    wl_event_source_timer_update(host->pacing_timeout_event_source, 0);
+  if (host->deadline_armed) {
+    wl_event_source_timer_update(host->deadline_event_source, 0);
+    host->deadline_armed = 0;
+  }
+}
+
+static int sl_handle_pacing_deadline(void* data) {
+  struct sl_host_surface* host = (struct sl_host_surface*)data;
+
+  host->deadline_armed = 0;
+  if (host->commit_held)
+    sl_host_surface_forward_commit(host);
+  return 0;
+}
+
+// Commits that coalesce keep being held after a frame until shortly before
+// the host is predicted to repaint, so that the latest of them makes it to
+// the screen. The repaint is predicted from the last presentation and the
+// refresh period of the host. Returns 0 if there is no prediction or the
+// deadline is too close to wait for.
+static int sl_host_surface_schedule_deadline(struct sl_host_surface* host) {
+  uint64_t now_us = sl_now_us();
+  uint64_t deadline_us;
+
+  if (!sl_host_surface_mailbox(host) || !host->present_us ||
+      !host->refresh_us || host->present_us > now_us)
+    return 0;
+
+  deadline_us = host->present_us +
+                ((now_us - host->present_us) / host->refresh_us + 1) *
+                    host->refresh_us;
+  if (deadline_us < now_us + PACING_DEADLINE_MARGIN_US + 1000)
+    return 0;
+
+  if (!host->deadline_event_source) {
+    host->deadline_event_source = wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->ctx->host_display),
+        sl_handle_pacing_deadline, host);
+  }
+  wl_event_source_timer_update(
+      host->deadline_event_source,
+      (deadline_us - now_us - PACING_DEADLINE_MARGIN_US) / 1000);
+  host->deadline_armed = 1;
+  return 1;
+}
+
+// Ends the frame that the pacing callback was requested for, whether the
+// host reported it or it timed out.
+static void sl_host_surface_pacing_end(struct sl_host_surface* host) {
+  struct sl_window* window;
+
+  sl_host_surface_cancel_pacing(host);
+
+  // Only the latest of the commits held since the last frame is forwarded.
+  if (!sl_host_surface_schedule_deadline(host) && host->commit_held)
+    sl_host_surface_forward_commit(host);
+
+  window = sl_host_surface_window(host);
+  if (window)
+    sl_window_frame_done(window);
+}
+
+static void sl_host_surface_pacing_done(struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+  uint64_t now_us = sl_now_us();
+  uint64_t latency_us = now_us - host->pacing_commit_us;
+
+  // Intervals longer than a second are pauses rather than frames.
+  if (ctx->stats.interval && host->frame_done_us &&
+      now_us - host->frame_done_us < 1000000) {
+    sl_histogram_add(&host->frame_interval, now_us - host->frame_done_us);
+  }
+  host->frame_done_us = now_us;
+
+  host->frame_latency_us =
+      host->frame_latency_us ? (host->frame_latency_us * 7 + latency_us) / 8
+                             : latency_us;
+
+  sl_host_surface_pacing_end(host);
+}
+
+static void sl_host_surface_pacing_callback_done(void* data,
+                                                 struct wl_callback* callback,
+                                                 uint32_t time) {
+  sl_host_surface_pacing_done(wl_callback_get_user_data(callback));
+}
+
+static const struct wl_callback_listener sl_host_surface_pacing_listener = {
+    sl_host_surface_pacing_callback_done};
+
+static void sl_host_surface_pacing_written(struct sl_stream_waiter* waiter) {
+  struct sl_host_surface* host =
+      wl_container_of(waiter, host, pacing_waiter);
+
+  sl_host_surface_pacing_done(host);
+}
+
+static int sl_handle_pacing_timeout(void* data) {
+  struct sl_host_surface* host = (struct sl_host_surface*)data;
+
+  sl_host_surface_pacing_end(host);
+  return 0;
+}
+
+// Forwards the commit of |host|, and any commit that was held before it, to
+// the host. Returns 0 if the commit is held instead, which only happens to
+// surfaces that coalesce commits while a frame is outstanding.
+int sl_host_surface_forward_commit(struct sl_host_surface* host) {
+  // A pacing callback is only outstanding if the last forwarded commit left
+  // a buffer attached. Commits that remove the buffer are never held, as
+  // the host doesn't send frame callbacks for unmapped surfaces. Subsurfaces
+  // take effect with their parent, which is paced instead. A client buffer
+  // that has been attached directly can't be held as the client is owed a
+  // release for it.
+  if ((sl_host_surface_pacing_outstanding(host) || host->deadline_armed) &&
+      host->buffer_attached && !host->subsurface_parent &&
+      sl_host_surface_mailbox(host) && !host->forwarded_attach) {
+    host->commit_held = 1;
+    return 0;
+  }
+
+  // The latency is measured from the oldest commit that has not been
+  // presented yet.
+  if (!host->buffer_attached) {
+    sl_host_surface_cancel_pacing(host);
+  } else if (!sl_host_surface_pacing_outstanding(host) &&
+             !host->subsurface_parent && sl_host_surface_paced(host)) {
+    host->pacing_commit_us = sl_now_us();
+    if (host->ctx->shm_driver == SHM_DRIVER_STREAM) {
+      sl_stream_wait(host->ctx, &host->pacing_waiter);
+    } else {
+      host->pacing_callback = wl_surface_frame(host->proxy);
+      wl_callback_add_listener(host->pacing_callback,
+                               &sl_host_surface_pacing_listener, host);
+      if (sl_host_surface_mailbox(host))
+        sl_host_surface_track_presentation(host);
+    }
+    if (!host->pacing_timeout_event_source) {
+      host->pacing_timeout_event_source = wl_event_loop_add_timer(
+          wl_display_get_event_loop(host->ctx->host_display),
+          sl_handle_pacing_timeout, host);
+    }
+    wl_event_source_timer_update(host->pacing_timeout_event_source,
+                                 PACING_TIMEOUT_MS);
+  }
+
+  wl_surface_commit(host->proxy);
+  sl_stats_surface_commit(host);
+  host->commit_held = 0;
+  host->pending_buffer = NULL;
+  host->forwarded_attach = 0;
+  return 1;
+}
+
+static void sl_host_surface_commit(struct wl_client* client,
+                                   struct wl_resource* resource) {
+  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_viewport* viewport = NULL;
+  struct sl_window* window;
+  int synchronized = sl_host_surface_sync_root(host) != host;
+
+  host->idle = 0;
+  sl_host_surface_presentation_commit(host);
+
+  if (!wl_list_empty(&host->contents_viewport))
+    viewport = wl_container_of(host->contents_viewport.next, viewport, link);
+
+  // A copy deferred by an earlier commit is superseded when this commit
+  // attaches something else, including no buffer at all. Otherwise it stays
+  // deferred while the surface is synchronized, and is done now if it no
+  // longer is. Damage is tracked per intermediate buffer until a copy
+  // clears it, so a deferred copy covers the damage of later commits, and
+  // the damage of commits whose copies are discarded is merged into the
+  // next copy to each buffer.
+  if (host->pending_copy.buffer) {
+    if (host->contents_shm_mmap ||
+        host->current_buffer != host->pending_copy.buffer) {
+      sl_host_surface_discard_pending_copy(host);
+    } else if (!synchronized) {
+      sl_host_surface_copy(host, &host->pending_copy);
+      sl_surface_copy_release(&host->pending_copy);
+    }
+  }
+
+  if (host->contents_shm_mmap) {
+    struct sl_surface_copy copy = {.buffer = host->current_buffer,
+                                   .shm_mmap = host->contents_shm_mmap,
+                                   .width = host->contents_width,
+                                   .height = host->contents_height,
+                                   .scale = host->contents_scale,
+                                   .has_viewport = viewport != NULL};
+
+    if (viewport)
+      copy.viewport = *viewport;
 
     wl_list_remove(&host->current_buffer->link);
     wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+
+    if (synchronized) {
+      // The client buffer is held until the copy is done.
+      host->pending_copy = copy;
+      host->contents_shm_mmap = NULL;
+    } else {
+      sl_host_surface_copy(host, &copy);
+    }
+  }
+
+  // Copies deferred by synchronized subsurfaces must be done before the
+  // commit that makes them take effect is forwarded.
+  if (synchronized)
+    sl_host_surface_link_pending_copy(host);
+  else
+    sl_host_surface_apply_pending_copies(host);
+
+  // Frame callbacks of stream surfaces are done once everything queued by
+  // this commit has been written.
+  while (!wl_list_empty(&host->stream_frame_callbacks)) {
+    struct sl_stream_waiter* waiter = wl_container_of(
+        host->stream_frame_callbacks.next, waiter, link);
+
+    wl_list_remove(&waiter->link);
+    sl_stream_wait(host->ctx, waiter);
   }
 
   if (host->contents_width && host->contents_height) {
@@ -593,7 +1410,7 @@ static void sl_host_surface_commit(struct wl_client* client,
   // No need to defer client commits if surface has a role. E.g. is a cursor
   // or shell surface.
   if (host->has_role) {
-    wl_surface_commit(host->proxy);
+    sl_host_surface_forward_commit(host);
 
     // GTK determines the scale based on the output the surface has entered.
     // If the surface has not entered any output, then have it enter the
@@ -616,9 +1433,15 @@ static void sl_host_surface_commit(struct wl_client* client,
     wl_list_for_each(window, &host->ctx->windows, link) {
       if (window->host_surface_id == wl_resource_get_id(resource)) {
         if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
+          sl_window_request_frame(window);
+          if (sl_host_surface_forward_commit(host) &&
+              sl_host_surface_mailbox(host)) {
+            sl_window_frame_done(window);
+          }
+          if (host->contents_width && host->contents_height) {
+            sl_stats_window_realized(window);
             window->realized = 1;
+          }
         }
         break;
       }
@@ -674,6 +1497,7 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_window *window, *surface_window = NULL;
   struct sl_output_buffer* buffer;
+  struct sl_host_surface* surface;
 
   wl_list_for_each(window, &host->ctx->windows, link) {
     if (window->host_surface_id == wl_resource_get_id(resource)) {
@@ -687,8 +1511,43 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
     sl_window_update(surface_window);
   }
 
+  wl_list_remove(&host->link);
+  if (host->pacing_callback)
+    wl_callback_destroy(host->pacing_callback);
+  wl_list_remove(&host->pacing_waiter.link);
+  if (host->pacing_timeout_event_source)
+    wl_event_source_remove(host->pacing_timeout_event_source);
+  if (host->deadline_event_source)
+    wl_event_source_remove(host->deadline_event_source);
+  if (host->presentation_feedback)
+    wp_presentation_feedback_destroy(host->presentation_feedback);
+  while (!wl_list_empty(&host->stream_frame_callbacks)) {
+    struct wl_list* link = host->stream_frame_callbacks.next;
+
+    wl_list_remove(link);
+    wl_list_init(link);
+  }
+  while (!wl_list_empty(&host->presentation_feedbacks)) {
+    struct wl_list* link = host->presentation_feedbacks.next;
+
+    wl_list_remove(link);
+    wl_list_init(link);
+  }
   if (host->contents_shm_mmap)
     sl_mmap_unref(host->contents_shm_mmap);
+  sl_host_surface_discard_pending_copy(host);
+
+  // Subsurfaces of a destroyed parent are no longer synchronized with it.
+  wl_list_for_each(surface, &host->ctx->surfaces, link) {
+    if (surface->subsurface_parent == host)
+      surface->subsurface_parent = NULL;
+  }
+  while (!wl_list_empty(&host->pending_children)) {
+    surface = wl_container_of(host->pending_children.next, surface,
+                              pending_link);
+    wl_list_remove(&surface->pending_link);
+    wl_list_init(&surface->pending_link);
+  }
 
   while (!wl_list_empty(&host->released_buffers)) {
     buffer = wl_container_of(host->released_buffers.next, buffer, link);
@@ -779,7 +1638,7 @@ static void sl_destroy_host_region(struct wl_resource* resource) {
 
   wl_region_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_slab_free(&sl_host_region_slab, host);
 }
 
 static void sl_compositor_create_host_surface(struct wl_client* client,
@@ -793,6 +1652,9 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   assert(host_surface);
 
   host_surface->ctx = host->compositor->ctx;
+  // Resource ids are only unique per client, so surfaces are identified by
+  // their own id in stats and the damage stream.
+  host_surface->id = ++host_surface->ctx->next_surface_id;
   host_surface->contents_width = 0;
   host_surface->contents_height = 0;
   host_surface->contents_scale = 1;
@@ -804,6 +1666,40 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->current_buffer = NULL;
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
+  host_surface->input_time_us = 0;
+  host_surface->idle = 0;
+  host_surface->idle_trim = 1;
+  host_surface->copy_full = 0;
+  host_surface->queue_depth = 0;
+  host_surface->coalesce_input = 0;
+  memset(&host_surface->perf, 0, sizeof(host_surface->perf));
+  host_surface->subsurface_parent = NULL;
+  host_surface->subsurface_sync = 0;
+  host_surface->pending_copy.buffer = NULL;
+  host_surface->pending_copy.shm_mmap = NULL;
+  wl_list_init(&host_surface->pending_children);
+  wl_list_init(&host_surface->pending_link);
+  host_surface->pacing_callback = NULL;
+  host_surface->pacing_commit_us = 0;
+  host_surface->frame_done_us = 0;
+  host_surface->frame_latency_us = 0;
+  sl_histogram_init(&host_surface->frame_interval, "frame-interval");
+  host_surface->pacing_timeout_event_source = NULL;
+  wl_list_init(&host_surface->pacing_waiter.link);
+  host_surface->pacing_waiter.done = sl_host_surface_pacing_written;
+  wl_list_init(&host_surface->stream_frame_callbacks);
+  host_surface->deadline_event_source = NULL;
+  host_surface->deadline_armed = 0;
+  host_surface->presentation_feedback = NULL;
+  wl_list_init(&host_surface->presentation_feedbacks);
+  host_surface->present_us = 0;
+  host_surface->refresh_us = 0;
+  host_surface->pacing = PACING_AUTO;
+  host_surface->buffer_attached = 0;
+  host_surface->commit_held = 0;
+  host_surface->forwarded_attach = 0;
+  host_surface->pending_buffer = NULL;
+  wl_list_insert(&host_surface->ctx->surfaces, &host_surface->link);
   host_surface->resource = wl_resource_create(
       client, &wl_surface_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_surface->resource,
@@ -836,8 +1732,7 @@ static void sl_compositor_create_host_region(struct wl_client* client,
   struct sl_host_compositor* host = wl_resource_get_user_data(resource);
   struct sl_host_region* host_region;
 
-  host_region = malloc(sizeof(*host_region));
-  assert(host_region);
+  host_region = sl_slab_alloc(&sl_host_region_slab);
 
   host_region->ctx = host->compositor->ctx;
   host_region->resource = wl_resource_create(
@@ -39,6 +39,7 @@ struct sl_host_data_offer {
 };
 
 struct sl_data_transfer {
+  struct sl_context* ctx;
   int read_fd;
   int write_fd;
   size_t offset;
@@ -46,8 +47,12 @@ struct sl_data_transfer {
   uint8_t data[4096];
   struct wl_event_source* read_event_source;
   struct wl_event_source* write_event_source;
+  struct sl_transfer stats;
 };
 
+static struct sl_slab sl_data_transfer_slab =
+    SL_SLAB_INIT(struct sl_data_transfer);
+
 static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
   assert(transfer->read_event_source);
   wl_event_source_remove(transfer->read_event_source);
@@ -55,7 +60,9 @@ static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
   wl_event_source_remove(transfer->write_event_source);
   close(transfer->read_fd);
   close(transfer->write_fd);
-  free(transfer);
+  sl_transfer_end(transfer->ctx, &transfer->ctx->stats.wayland_to_wayland,
+                  &transfer->stats);
+  sl_slab_free(&sl_data_transfer_slab, transfer);
 }
 
 static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
@@ -84,6 +91,7 @@ static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
 
   transfer->bytes_left =
       read(transfer->read_fd, transfer->data, sizeof(transfer->data));
+  sl_transfer_progress(&transfer->stats, transfer->bytes_left);
   if (transfer->bytes_left > 0) {
     transfer->offset = 0;
     // There may still be data to read from the event source, but we have no
@@ -116,6 +124,7 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
 
   rv = write(transfer->write_fd, transfer->data + transfer->offset,
              transfer->bytes_left);
+  sl_transfer_progress(&transfer->stats, 0);
 
   if (rv < 0) {
     // On a write error, end the transfer.
@@ -136,9 +145,11 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   return 0;
 }
 
-static void sl_data_transfer_create(struct wl_event_loop* event_loop,
+static void sl_data_transfer_create(struct sl_context* ctx,
                                     int read_fd,
                                     int write_fd) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
   struct sl_data_transfer* transfer;
   int flags;
   int rv;
@@ -149,12 +160,13 @@ static void sl_data_transfer_create(struct wl_event_loop* event_loop,
   UNUSED(rv);
 
   // Start out the transfer in the reading state.
-  transfer = malloc(sizeof(*transfer));
-  assert(transfer);
+  transfer = sl_slab_alloc(&sl_data_transfer_slab);
+  transfer->ctx = ctx;
   transfer->read_fd = read_fd;
   transfer->write_fd = write_fd;
   transfer->offset = 0;
   transfer->bytes_left = 0;
+  sl_transfer_begin(ctx, &transfer->stats);
   transfer->read_event_source =
       wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
                            sl_handle_data_transfer_read, transfer);
@@ -195,8 +207,7 @@ static void sl_data_offer_receive(struct wl_client* client,
         return;
       }
 
-      sl_data_transfer_create(
-          wl_display_get_event_loop(host->ctx->host_display), new_pipe.fd, fd);
+      sl_data_transfer_create(host->ctx, new_pipe.fd, fd);
 
       wl_data_offer_receive(host->proxy, mime_type, new_pipe.fd);
     } break;
@@ -50,7 +50,7 @@ static void sl_host_callback_destroy(struct wl_resource* resource) {
 
   wl_callback_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_slab_free(&sl_host_callback_slab, host);
 }
 
 static void sl_display_sync(struct wl_client* client,
@@ -59,8 +59,7 @@ static void sl_display_sync(struct wl_client* client,
   struct sl_context* ctx = wl_resource_get_user_data(resource);
   struct sl_host_callback* host_callback;
 
-  host_callback = malloc(sizeof(*host_callback));
-  assert(host_callback);
+  host_callback = sl_slab_alloc(&sl_host_callback_slab);
 
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, id);
@@ -20,6 +20,10 @@
 // to note the DPI of a typical monitor circa ~2005, i.e. 20" 1080p.
 #define DEFACTO_DPI 96
 
+// Output changes that arrive within this many milliseconds of each other
+// are sent to Xwayland together.
+#define OUTPUT_SETTLE_MS 50
+
 double sl_output_aura_scale_factor_to_double(int scale_factor) {
   // Aura scale factor is an enum that for all currently know values
   // is a scale value multipled by 1000. For example, enum value for
@@ -129,7 +133,8 @@ void sl_output_get_host_output_state(struct sl_host_output* host,
   }
 }
 
-void sl_output_send_host_output_state(struct sl_host_output* host) {
+static void sl_output_derive_host_output_state(
+    struct sl_host_output* host, struct sl_host_output_state* state) {
   int scale;
   int physical_width;
   int physical_height;
@@ -161,19 +166,88 @@ void sl_output_send_host_output_state(struct sl_host_output* host) {
     }
   }
 
+  memset(state, 0, sizeof(*state));
+  state->scale = scale;
+  state->physical_width = physical_width;
+  state->physical_height = physical_height;
+  state->width = width;
+  state->height = height;
+  state->subpixel = host->subpixel;
+  state->transform = host->transform;
+  state->flags = host->flags;
+  state->refresh = host->refresh;
+}
+
+static void sl_output_send_state(struct sl_host_output* host,
+                                 struct sl_host_output_state* state) {
   // X/Y are best left at origin as managed X windows are kept centered on
   // the root window. The result is that all outputs are overlapping and
   // pointer events can always be dispatched to the visible region of the
   // window.
-  wl_output_send_geometry(host->resource, 0, 0, physical_width, physical_height,
-                          host->subpixel, host->make, host->model,
-                          host->transform);
-  wl_output_send_mode(host->resource, host->flags | WL_OUTPUT_MODE_CURRENT,
-                      width, height, host->refresh);
+  wl_output_send_geometry(host->resource, 0, 0, state->physical_width,
+                          state->physical_height, state->subpixel, host->make,
+                          host->model, state->transform);
+  wl_output_send_mode(host->resource, state->flags | WL_OUTPUT_MODE_CURRENT,
+                      state->width, state->height, state->refresh);
   if (wl_resource_get_version(host->resource) >= WL_OUTPUT_SCALE_SINCE_VERSION)
-    wl_output_send_scale(host->resource, scale);
+    wl_output_send_scale(host->resource, state->scale);
   if (wl_resource_get_version(host->resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
     wl_output_send_done(host->resource);
+
+  host->sent_state = *state;
+  host->state_sent = 1;
+  host->state_forced = 0;
+}
+
+void sl_output_send_host_output_state(struct sl_host_output* host) {
+  struct sl_host_output_state state;
+
+  sl_output_derive_host_output_state(host, &state);
+  sl_output_send_state(host, &state);
+}
+
+static int sl_handle_output_settle_timer(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_host_output* output;
+
+  // All outputs are checked as the density of the internal output affects
+  // the state of every other output.
+  wl_list_for_each(output, &ctx->host_outputs, link) {
+    struct sl_host_output_state state;
+
+    // Outputs that have not completed their initial state yet send it on
+    // their own.
+    if (!output->state_sent)
+      continue;
+
+    sl_output_derive_host_output_state(output, &state);
+    if (output->state_forced ||
+        memcmp(&state, &output->sent_state, sizeof(state))) {
+      sl_output_send_state(output, &state);
+    }
+  }
+  return 0;
+}
+
+// Each output update makes Xwayland reconfigure RandR and notify every X
+// client, which then relayout. Updates are coalesced over a short settle
+// window and dropped if the state sent to clients stays the same. The
+// initial state and plain Wayland clients are not delayed.
+static void sl_output_schedule_host_output_state(struct sl_host_output* host) {
+  struct sl_context* ctx = host->ctx;
+
+  if (!ctx->xwayland || !host->state_sent) {
+    sl_output_send_host_output_state(host);
+    return;
+  }
+
+  if (!ctx->output_settle_event_source) {
+    ctx->output_settle_event_source =
+        wl_event_loop_add_timer(wl_display_get_event_loop(ctx->host_display),
+                                sl_handle_output_settle_timer, ctx);
+  }
+  wl_event_source_timer_update(ctx->output_settle_event_source,
+                               OUTPUT_SETTLE_MS);
 }
 
 static void sl_output_geometry(void* data,
@@ -193,6 +267,10 @@ static void sl_output_geometry(void* data,
   host->physical_width = physical_width;
   host->physical_height = physical_height;
   host->subpixel = subpixel;
+  // Make and model are not part of the derived state, so a change to them
+  // always has to be sent.
+  if (strcmp(host->model, model) || strcmp(host->make, make))
+    host->state_forced = 1;
   free(host->model);
   host->model = strdup(model);
   free(host->make);
@@ -221,7 +299,7 @@ static void sl_output_done(void* data, struct wl_output* output) {
   if (host->expecting_scale)
     return;
 
-  sl_output_send_host_output_state(host);
+  sl_output_schedule_host_output_state(host);
 
   // Expect scale if aura output exists.
   if (host->aura_output)
@@ -330,6 +408,8 @@ static void sl_bind_host_output(struct wl_client* client,
   host->preferred_scale = 1000;
   host->device_scale_factor = 1000;
   host->expecting_scale = 0;
+  host->state_sent = 0;
+  host->state_forced = 0;
   wl_list_insert(ctx->host_outputs.prev, &host->link);
   if (ctx->aura_shell) {
     host->expecting_scale = 1;
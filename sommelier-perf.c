@@ -0,0 +1,188 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} sl_perf_events[SL_PERF_COUNTERS] = {
+    [SL_PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [SL_PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [SL_PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [SL_PERF_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                             PERF_COUNT_HW_CACHE_DTLB |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+static const char* sl_perf_stage_names[SL_PERF_STAGES] = {
+    [SL_PERF_STAGE_COPY_SHM] = "copy-shm",
+    [SL_PERF_STAGE_COPY_DMABUF] = "copy-dmabuf",
+    [SL_PERF_STAGE_STREAM] = "stream-encode",
+    [SL_PERF_STAGE_VERIFY] = "verify-copy",
+};
+
+static int sl_perf_event_open(int counter, int group_fd) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = sl_perf_events[counter].type;
+  attr.config = sl_perf_events[counter].config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  // Only user space is counted, which works without privileges at the
+  // default perf_event_paranoid level.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  // Counts the calling thread on any CPU.
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+// Opens all counters as one group so that they are read together. Cycles
+// lead the group and are required, other counters are left out if the CPU
+// or kernel doesn't support them.
+void sl_perf_init(struct sl_context* ctx) {
+  struct sl_perf* perf = &ctx->perf;
+  int i;
+
+  perf->fd = sl_perf_event_open(SL_PERF_CYCLES, -1);
+  if (perf->fd < 0) {
+    fprintf(stderr, "error: perf counters unavailable: %s\n",
+            strerror(errno));
+    return;
+  }
+
+  perf->count = 1;
+  perf->index[SL_PERF_CYCLES] = 0;
+  for (i = SL_PERF_CYCLES + 1; i < SL_PERF_COUNTERS; ++i) {
+    int fd = sl_perf_event_open(i, perf->fd);
+
+    // Closing a member removes it from the group, so member fds are kept
+    // open for the lifetime of the process and only the leader is read.
+    perf->index[i] = fd < 0 ? -1 : perf->count++;
+  }
+}
+
+void sl_perf_read(struct sl_context* ctx, uint64_t* values) {
+  struct sl_perf* perf = &ctx->perf;
+  uint64_t data[1 + SL_PERF_COUNTERS];
+  int i;
+
+  if (perf->fd < 0)
+    return;
+
+  if (read(perf->fd, data, sizeof(data)) < (ssize_t)sizeof(uint64_t))
+    memset(data, 0, sizeof(data));
+
+  // Data starts with the number of counters in the group.
+  for (i = 0; i < SL_PERF_COUNTERS; ++i)
+    values[i] = perf->index[i] >= 0 ? data[1 + perf->index[i]] : 0;
+}
+
+static void sl_perf_sample_add(struct sl_perf_sample* sample,
+                               const uint64_t* values,
+                               size_t bytes) {
+  int i;
+
+  sample->bytes += bytes;
+  for (i = 0; i < SL_PERF_COUNTERS; ++i)
+    sample->values[i] += values[i];
+}
+
+// Adds the counts since |start| was read to |stage| and, if not NULL, to
+// |surface|.
+void sl_perf_add(struct sl_context* ctx,
+                 int stage,
+                 const uint64_t* start,
+                 size_t bytes,
+                 struct sl_perf_sample* surface) {
+  uint64_t values[SL_PERF_COUNTERS];
+  int i;
+
+  if (ctx->perf.fd < 0)
+    return;
+
+  sl_perf_read(ctx, values);
+  for (i = 0; i < SL_PERF_COUNTERS; ++i)
+    values[i] -= start[i];
+
+  sl_perf_sample_add(&ctx->perf.stages[stage], values, bytes);
+  if (surface)
+    sl_perf_sample_add(surface, values, bytes);
+}
+
+static void sl_perf_format_ratio(char* buf,
+                                 size_t size,
+                                 struct sl_context* ctx,
+                                 int counter,
+                                 uint64_t value,
+                                 double divisor) {
+  if (ctx->perf.index[counter] < 0 || !divisor)
+    snprintf(buf, size, "n/a");
+  else
+    snprintf(buf, size, "%.3f", value / divisor);
+}
+
+static void sl_perf_report_sample(struct sl_context* ctx,
+                                  const char* name,
+                                  uint32_t surface_id,
+                                  struct sl_perf_sample* sample) {
+  uint64_t* values = sample->values;
+  char cycles[32], ipc[32], llc[32], dtlb[32];
+  double kb = sample->bytes / 1024.0;
+
+  sl_perf_format_ratio(cycles, sizeof(cycles), ctx, SL_PERF_CYCLES,
+                       values[SL_PERF_CYCLES], sample->bytes);
+  sl_perf_format_ratio(ipc, sizeof(ipc), ctx, SL_PERF_INSTRUCTIONS,
+                       values[SL_PERF_INSTRUCTIONS], values[SL_PERF_CYCLES]);
+  sl_perf_format_ratio(llc, sizeof(llc), ctx, SL_PERF_LLC_MISSES,
+                       values[SL_PERF_LLC_MISSES], kb);
+  sl_perf_format_ratio(dtlb, sizeof(dtlb), ctx, SL_PERF_DTLB_MISSES,
+                       values[SL_PERF_DTLB_MISSES], kb);
+
+  fprintf(stderr, "stats: perf: %s", name);
+  if (surface_id)
+    fprintf(stderr, " surface=%u", surface_id);
+  fprintf(stderr,
+          " driver=%s bytes=%" PRIu64
+          " cycles-per-byte=%s ipc=%s llc-misses-per-kb=%s"
+          " dtlb-misses-per-kb=%s\n",
+          sl_shm_driver_name(ctx->shm_driver), sample->bytes, cycles, ipc,
+          llc, dtlb);
+  memset(sample, 0, sizeof(*sample));
+}
+
+void sl_perf_report(struct sl_context* ctx) {
+  struct sl_host_surface* host;
+  int i;
+
+  if (ctx->perf.fd < 0)
+    return;
+
+  for (i = 0; i < SL_PERF_STAGES; ++i) {
+    if (ctx->perf.stages[i].bytes) {
+      sl_perf_report_sample(ctx, sl_perf_stage_names[i], 0,
+                            &ctx->perf.stages[i]);
+    }
+  }
+
+  // Surfaces only track the copy, as that is where contents are touched
+  // for every commit.
+  wl_list_for_each(host, &ctx->surfaces, link) {
+    if (host->perf.bytes) {
+      sl_perf_report_sample(ctx, "copy", host->id, &host->perf);
+    }
+  }
+}
@@ -0,0 +1,289 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "presentation-time-client-protocol.h"
+#include "presentation-time-server-protocol.h"
+
+// Number of presentation events that the clock offset is estimated from.
+#define CLOCK_OFFSET_WINDOW 120
+
+struct sl_host_presentation {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct wp_presentation* proxy;
+};
+
+// Feedback objects can outlive the wp_presentation object and the surface
+// that created them, so everything needed to handle their events is
+// copied. Feedback is linked to its surface until the commit it applies to.
+struct sl_host_presentation_feedback {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct wp_presentation_feedback* proxy;
+  struct wl_list link;
+  uint64_t commit_us;
+};
+
+static struct sl_slab sl_host_presentation_feedback_slab =
+    SL_SLAB_INIT(struct sl_host_presentation_feedback);
+
+// Translates a host presentation timestamp to the CLOCK_MONOTONIC domain of
+// sommelier, which is what clients are told timestamps are in. The host
+// clock can belong to another machine, so its offset is estimated from
+// when the presentation events are received. Events arrive some time after
+// the presentation, so the smallest difference seen is the closest to the
+// actual offset. The estimate is taken over windows of events, so that it
+// follows the clocks if they drift apart.
+static uint64_t sl_presentation_translate(struct sl_context* ctx,
+                                          uint64_t host_ns) {
+  struct sl_clock_offset* clock = &ctx->host_clock;
+  int64_t offset_ns = (int64_t)(sl_now_us() * 1000 - host_ns);
+
+  if (!clock->samples || offset_ns < clock->window_ns)
+    clock->window_ns = offset_ns;
+  if (++clock->samples == CLOCK_OFFSET_WINDOW) {
+    clock->offset_ns = clock->window_ns;
+    clock->valid = 1;
+    clock->samples = 0;
+  }
+
+  offset_ns = clock->samples ? clock->window_ns : clock->offset_ns;
+  if (clock->valid && clock->offset_ns < offset_ns)
+    offset_ns = clock->offset_ns;
+
+  return host_ns + offset_ns;
+}
+
+static uint64_t sl_presentation_timestamp(uint32_t tv_sec_hi,
+                                          uint32_t tv_sec_lo,
+                                          uint32_t tv_nsec) {
+  return (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
+}
+
+static void sl_presentation_feedback_sync_output(
+    void* data,
+    struct wp_presentation_feedback* presentation_feedback,
+    struct wl_output* output) {
+  struct sl_host_presentation_feedback* host =
+      wp_presentation_feedback_get_user_data(presentation_feedback);
+  struct sl_host_output* host_output = wl_output_get_user_data(output);
+
+  // The host sends this once for each wl_output bound by sommelier, and
+  // those are shared between all clients. Only outputs that belong to the
+  // client of the feedback can be forwarded.
+  if (wl_resource_get_client(host_output->resource) !=
+      wl_resource_get_client(host->resource))
+    return;
+
+  wp_presentation_feedback_send_sync_output(host->resource,
+                                            host_output->resource);
+}
+
+static void sl_presentation_feedback_presented(
+    void* data,
+    struct wp_presentation_feedback* presentation_feedback,
+    uint32_t tv_sec_hi,
+    uint32_t tv_sec_lo,
+    uint32_t tv_nsec,
+    uint32_t refresh,
+    uint32_t seq_hi,
+    uint32_t seq_lo,
+    uint32_t flags) {
+  struct sl_host_presentation_feedback* host =
+      wp_presentation_feedback_get_user_data(presentation_feedback);
+  struct sl_context* ctx = host->ctx;
+  uint64_t present_ns = sl_presentation_translate(
+      ctx, sl_presentation_timestamp(tv_sec_hi, tv_sec_lo, tv_nsec));
+  uint64_t sec = present_ns / 1000000000;
+
+  if (ctx->stats.interval && host->commit_us &&
+      present_ns / 1000 > host->commit_us) {
+    sl_histogram_add(&ctx->stats.present_latency,
+                     present_ns / 1000 - host->commit_us);
+  }
+
+  wp_presentation_feedback_send_presented(
+      host->resource, sec >> 32, sec & 0xffffffff, present_ns % 1000000000,
+      refresh, seq_hi, seq_lo, flags);
+  wl_resource_destroy(host->resource);
+}
+
+static void sl_presentation_feedback_discarded(
+    void* data, struct wp_presentation_feedback* presentation_feedback) {
+  struct sl_host_presentation_feedback* host =
+      wp_presentation_feedback_get_user_data(presentation_feedback);
+
+  wp_presentation_feedback_send_discarded(host->resource);
+  wl_resource_destroy(host->resource);
+}
+
+static const struct wp_presentation_feedback_listener
+    sl_presentation_feedback_listener = {sl_presentation_feedback_sync_output,
+                                         sl_presentation_feedback_presented,
+                                         sl_presentation_feedback_discarded};
+
+static void sl_destroy_host_presentation_feedback(
+    struct wl_resource* resource) {
+  struct sl_host_presentation_feedback* host =
+      wl_resource_get_user_data(resource);
+
+  wl_list_remove(&host->link);
+  wp_presentation_feedback_destroy(host->proxy);
+  wl_resource_set_user_data(resource, NULL);
+  sl_slab_free(&sl_host_presentation_feedback_slab, host);
+}
+
+static void sl_presentation_destroy(struct wl_client* client,
+                                    struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_presentation_feedback(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     struct wl_resource* surface_resource,
+                                     uint32_t id) {
+  struct sl_host_presentation* host = wl_resource_get_user_data(resource);
+  struct sl_host_surface* host_surface =
+      wl_resource_get_user_data(surface_resource);
+  struct sl_host_presentation_feedback* host_feedback;
+
+  host_feedback = sl_slab_alloc(&sl_host_presentation_feedback_slab);
+  host_feedback->ctx = host->ctx;
+  host_feedback->commit_us = 0;
+  wl_list_insert(host_surface->presentation_feedbacks.prev,
+                 &host_feedback->link);
+  host_feedback->resource =
+      wl_resource_create(client, &wp_presentation_feedback_interface, 1, id);
+  wl_resource_set_implementation(host_feedback->resource, NULL, host_feedback,
+                                 sl_destroy_host_presentation_feedback);
+  host_feedback->proxy = wp_presentation_feedback(host->proxy,
+                                                  host_surface->proxy);
+  wp_presentation_feedback_set_user_data(host_feedback->proxy, host_feedback);
+  wp_presentation_feedback_add_listener(host_feedback->proxy,
+                                        &sl_presentation_feedback_listener,
+                                        host_feedback);
+}
+
+static const struct wp_presentation_interface sl_presentation_implementation =
+    {sl_presentation_destroy, sl_presentation_feedback};
+
+// Timestamps are translated, so the clock of the host is not forwarded.
+static void sl_presentation_clock_id(void* data,
+                                     struct wp_presentation* presentation,
+                                     uint32_t clk_id) {}
+
+static const struct wp_presentation_listener sl_presentation_listener = {
+    sl_presentation_clock_id};
+
+static void sl_destroy_host_presentation(struct wl_resource* resource) {
+  struct sl_host_presentation* host = wl_resource_get_user_data(resource);
+
+  wp_presentation_destroy(host->proxy);
+  wl_resource_set_user_data(resource, NULL);
+  free(host);
+}
+
+static void sl_bind_host_presentation(struct wl_client* client,
+                                      void* data,
+                                      uint32_t version,
+                                      uint32_t id) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_host_presentation* host;
+
+  host = malloc(sizeof(*host));
+  assert(host);
+  host->ctx = ctx;
+  host->resource =
+      wl_resource_create(client, &wp_presentation_interface, 1, id);
+  wl_resource_set_implementation(host->resource,
+                                 &sl_presentation_implementation, host,
+                                 sl_destroy_host_presentation);
+  wp_presentation_send_clock_id(host->resource, CLOCK_MONOTONIC);
+  host->proxy =
+      wl_registry_bind(wl_display_get_registry(ctx->display),
+                       ctx->presentation->id, &wp_presentation_interface, 1);
+  wp_presentation_set_user_data(host->proxy, host);
+  wp_presentation_add_listener(host->proxy, &sl_presentation_listener, host);
+}
+
+// Feedback requested by clients applies to the next commit of the surface.
+void sl_host_surface_presentation_commit(struct sl_host_surface* host) {
+  uint64_t now_us = sl_now_us();
+
+  while (!wl_list_empty(&host->presentation_feedbacks)) {
+    struct sl_host_presentation_feedback* feedback = wl_container_of(
+        host->presentation_feedbacks.next, feedback, link);
+
+    feedback->commit_us = now_us;
+    wl_list_remove(&feedback->link);
+    wl_list_init(&feedback->link);
+  }
+}
+
+static void sl_internal_presentation_feedback_sync_output(
+    void* data,
+    struct wp_presentation_feedback* presentation_feedback,
+    struct wl_output* output) {}
+
+static void sl_internal_presentation_feedback_presented(
+    void* data,
+    struct wp_presentation_feedback* presentation_feedback,
+    uint32_t tv_sec_hi,
+    uint32_t tv_sec_lo,
+    uint32_t tv_nsec,
+    uint32_t refresh,
+    uint32_t seq_hi,
+    uint32_t seq_lo,
+    uint32_t flags) {
+  struct sl_host_surface* host =
+      wp_presentation_feedback_get_user_data(presentation_feedback);
+  uint64_t present_ns = sl_presentation_translate(
+      host->ctx, sl_presentation_timestamp(tv_sec_hi, tv_sec_lo, tv_nsec));
+
+  host->present_us = present_ns / 1000;
+  host->refresh_us = refresh / 1000;
+  wp_presentation_feedback_destroy(presentation_feedback);
+  host->presentation_feedback = NULL;
+}
+
+static void sl_internal_presentation_feedback_discarded(
+    void* data, struct wp_presentation_feedback* presentation_feedback) {
+  struct sl_host_surface* host =
+      wp_presentation_feedback_get_user_data(presentation_feedback);
+
+  wp_presentation_feedback_destroy(presentation_feedback);
+  host->presentation_feedback = NULL;
+}
+
+static const struct wp_presentation_feedback_listener
+    sl_internal_presentation_feedback_listener = {
+        sl_internal_presentation_feedback_sync_output,
+        sl_internal_presentation_feedback_presented,
+        sl_internal_presentation_feedback_discarded};
+
+// Requests feedback for the next commit of |host|, which tells when the
+// host presents and how often it refreshes.
+void sl_host_surface_track_presentation(struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+
+  if (!ctx->presentation || host->presentation_feedback)
+    return;
+
+  host->presentation_feedback =
+      wp_presentation_feedback(ctx->presentation->internal, host->proxy);
+  wp_presentation_feedback_add_listener(
+      host->presentation_feedback, &sl_internal_presentation_feedback_listener,
+      host);
+}
+
+struct sl_global* sl_presentation_global_create(struct sl_context* ctx) {
+  return sl_global_create(ctx, &wp_presentation_interface, 1, ctx,
+                          sl_bind_host_presentation);
+}
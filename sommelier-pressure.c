@@ -0,0 +1,202 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define PSI_MEMORY_PATH "/proc/pressure/memory"
+// Some task stalled on memory for 150ms within a 1s window.
+#define PSI_MEMORY_TRIGGER "some 150000 1000000"
+
+#define CGROUP_PATH "/proc/self/cgroup"
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+// Releases memory that can be recreated on demand and reports how much was
+// freed. Intermediate buffers are the only large allocations that sommelier
+// holds on to without needing them. Clipboard data is already released when
+// each transfer completes and keymaps are in use for as long as the keyboard
+// exists, so neither is shed here.
+static void sl_memory_pressure_shed(struct sl_context* ctx) {
+  struct sl_host_surface* host;
+  size_t buffer_bytes = 0;
+  size_t staging_bytes;
+  size_t slab_bytes;
+
+  wl_list_for_each(host, &ctx->surfaces, link) {
+    buffer_bytes += sl_host_surface_release_buffers(host);
+  }
+
+  // Staging blocks that became empty as a result are returned as well.
+  staging_bytes = sl_staging_trim(ctx);
+  // So are slab chunks that no longer hold live objects.
+  slab_bytes = sl_slab_trim();
+
+  // Return memory released by the above and by earlier frees to the system.
+  malloc_trim(0);
+
+  // Diagnostics are only reported with stats enabled.
+  if (!ctx->stats.interval)
+    return;
+
+  fprintf(stderr,
+          "memory pressure: released %zu bytes of buffers, %zu bytes of "
+          "staging blocks, %zu bytes of slab chunks\n",
+          buffer_bytes, staging_bytes, slab_bytes);
+}
+
+static int sl_handle_psi_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct epoll_event event;
+
+  if (epoll_wait(fd, &event, 1, 0) != 1)
+    return 0;
+
+  if (event.events & EPOLLERR) {
+    fprintf(stderr, "error: memory pressure trigger lost\n");
+    wl_event_source_remove(ctx->memory_pressure.event_source);
+    ctx->memory_pressure.event_source = NULL;
+    return 0;
+  }
+
+  sl_memory_pressure_shed(ctx);
+  return 0;
+}
+
+// Returns the number of times the cgroup has been throttled or hit its
+// limit, or 0 if the events file can't be read.
+static uint64_t sl_cgroup_memory_events(const char* path) {
+  uint64_t events = 0;
+  char key[32];
+  uint64_t value;
+  FILE* file;
+
+  file = fopen(path, "r");
+  if (!file)
+    return 0;
+
+  while (fscanf(file, "%31s %" SCNu64, key, &value) == 2) {
+    if (!strcmp(key, "high") || !strcmp(key, "max"))
+      events += value;
+  }
+  fclose(file);
+
+  return events;
+}
+
+static int sl_handle_cgroup_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  char buf[4096];
+  uint64_t events;
+
+  // Drain the inotify queue. The contents of the events don't matter.
+  while (read(fd, buf, sizeof(buf)) > 0)
+    continue;
+
+  events = sl_cgroup_memory_events(ctx->memory_pressure.events_path);
+  if (events > ctx->memory_pressure.events)
+    sl_memory_pressure_shed(ctx);
+  ctx->memory_pressure.events = events;
+  return 0;
+}
+
+static int sl_memory_pressure_watch_psi(struct sl_context* ctx) {
+  struct epoll_event event = {.events = EPOLLPRI};
+  int fd, epoll_fd;
+
+  fd = open(PSI_MEMORY_PATH, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  if (write(fd, PSI_MEMORY_TRIGGER, strlen(PSI_MEMORY_TRIGGER) + 1) < 0) {
+    close(fd);
+    return 0;
+  }
+
+  // PSI triggers are signaled with POLLPRI, which the event loop does not
+  // expose, so the trigger is polled through a nested epoll instance.
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  assert(epoll_fd >= 0);
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+    close(epoll_fd);
+    close(fd);
+    return 0;
+  }
+
+  ctx->memory_pressure.fd = fd;
+  ctx->memory_pressure.event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), epoll_fd,
+      WL_EVENT_READABLE, sl_handle_psi_event, ctx);
+  return 1;
+}
+
+static int sl_memory_pressure_watch_cgroup(struct sl_context* ctx) {
+  char line[4096];
+  FILE* file;
+  int fd, rv;
+
+  file = fopen(CGROUP_PATH, "r");
+  if (!file)
+    return 0;
+
+  // The unified hierarchy is listed as "0::/path".
+  while (fgets(line, sizeof(line), file)) {
+    if (!strncmp(line, "0::", 3)) {
+      line[strcspn(line, "\n")] = '\0';
+      rv = asprintf(&ctx->memory_pressure.events_path,
+                    "%s%s/memory.events", CGROUP_ROOT, line + 3);
+      assert(rv >= 0);
+      UNUSED(rv);
+      break;
+    }
+  }
+  fclose(file);
+
+  if (!ctx->memory_pressure.events_path)
+    return 0;
+
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  assert(fd >= 0);
+  if (inotify_add_watch(fd, ctx->memory_pressure.events_path, IN_MODIFY) < 0) {
+    close(fd);
+    free(ctx->memory_pressure.events_path);
+    ctx->memory_pressure.events_path = NULL;
+    return 0;
+  }
+
+  ctx->memory_pressure.events =
+      sl_cgroup_memory_events(ctx->memory_pressure.events_path);
+  ctx->memory_pressure.event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), fd, WL_EVENT_READABLE,
+      sl_handle_cgroup_event, ctx);
+  return 1;
+}
+
+void sl_memory_pressure_init(struct sl_context* ctx) {
+  const char* source = NULL;
+
+  if (sl_memory_pressure_watch_psi(ctx))
+    source = PSI_MEMORY_PATH;
+  else if (sl_memory_pressure_watch_cgroup(ctx))
+    source = ctx->memory_pressure.events_path;
+
+  // Like what is released, the active source is only reported with stats.
+  if (!ctx->stats.interval)
+    return;
+
+  if (source)
+    fprintf(stderr, "memory pressure: watching %s\n", source);
+  else
+    fprintf(stderr, "memory pressure: no pressure source available\n");
+}
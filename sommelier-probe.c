@@ -0,0 +1,80 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wayland-client.h>
+
+// The host is considered to fall behind when round trips, including two
+// times the jitter, take longer than a frame at 60Hz. It has recovered once
+// they take less than half of that.
+#define HOST_PROBE_SLOW_US 16667
+#define HOST_PROBE_RECOVERED_US (HOST_PROBE_SLOW_US / 2)
+
+static void sl_host_probe_done(void* data,
+                               struct wl_callback* callback,
+                               uint32_t serial) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_host_probe* probe = &ctx->host_probe;
+  uint64_t rtt_us = sl_now_us() - probe->sent_us;
+  uint64_t deviation_us;
+  uint64_t delay_us;
+
+  wl_callback_destroy(callback);
+  probe->callback = NULL;
+
+  if (ctx->stats.interval)
+    sl_histogram_add(&ctx->stats.host_rtt, rtt_us);
+
+  // Smoothed round trip time and mean deviation, with the same gains as
+  // TCP uses for its retransmission timer.
+  if (!probe->rtt_us) {
+    probe->rtt_us = rtt_us;
+    probe->jitter_us = rtt_us / 2;
+  } else {
+    deviation_us = rtt_us > probe->rtt_us ? rtt_us - probe->rtt_us
+                                          : probe->rtt_us - rtt_us;
+    probe->jitter_us = (probe->jitter_us * 3 + deviation_us) / 4;
+    probe->rtt_us = (probe->rtt_us * 7 + rtt_us) / 8;
+  }
+
+  delay_us = probe->rtt_us + probe->jitter_us * 2;
+  if (!probe->slow && delay_us > HOST_PROBE_SLOW_US) {
+    probe->slow = 1;
+  } else if (probe->slow && delay_us < HOST_PROBE_RECOVERED_US) {
+    probe->slow = 0;
+  }
+}
+
+static const struct wl_callback_listener sl_host_probe_listener = {
+    sl_host_probe_done};
+
+static int sl_handle_host_probe_timer(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_host_probe* probe = &ctx->host_probe;
+
+  // A probe that is still outstanding is left to complete, as its round
+  // trip time is what tells that the host is falling behind.
+  if (!probe->callback) {
+    probe->sent_us = sl_now_us();
+    probe->callback = wl_display_sync(ctx->display);
+    wl_callback_add_listener(probe->callback, &sl_host_probe_listener, ctx);
+  }
+
+  wl_event_source_timer_update(probe->timer_event_source, probe->interval);
+  return 0;
+}
+
+void sl_host_probe_init(struct sl_context* ctx, int interval) {
+  struct sl_host_probe* probe = &ctx->host_probe;
+
+  probe->interval = interval;
+  probe->timer_event_source =
+      wl_event_loop_add_timer(wl_display_get_event_loop(ctx->host_display),
+                              sl_handle_host_probe_timer, ctx);
+  wl_event_source_timer_update(probe->timer_event_source, interval);
+}
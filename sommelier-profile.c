@@ -0,0 +1,149 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int sl_profile_set_option(struct sl_profile* profile,
+                                 const char* option) {
+  const char* value = strchr(option, '=');
+
+  if (!value)
+    return 0;
+  ++value;
+
+  if (strstr(option, "frame-sync=") == option) {
+    profile->frame_sync = !!atoi(value);
+  } else if (strstr(option, "idle-trim=") == option) {
+    profile->idle_trim = !!atoi(value);
+  } else if (strstr(option, "copy=") == option) {
+    if (!strcmp(value, "full"))
+      profile->copy_full = 1;
+    else if (!strcmp(value, "damage"))
+      profile->copy_full = 0;
+    else
+      return 0;
+  } else if (strstr(option, "pacing=") == option) {
+    if (!strcmp(value, "auto"))
+      profile->pacing = PACING_AUTO;
+    else if (!strcmp(value, "fifo"))
+      profile->pacing = PACING_FIFO;
+    else if (!strcmp(value, "mailbox"))
+      profile->pacing = PACING_MAILBOX;
+    else
+      return 0;
+  } else if (strstr(option, "queue-depth=") == option) {
+    profile->queue_depth = atoi(value);
+    if (profile->queue_depth < 0)
+      return 0;
+  } else if (strstr(option, "coalesce-input=") == option) {
+    profile->coalesce_input = !!atoi(value);
+  } else if (strstr(option, "shm-driver=") == option) {
+    free(profile->shm_driver);
+    profile->shm_driver = strdup(value);
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+// Each line of the profiles file holds a match string followed by options,
+// for example "org.example.Player frame-sync=0 idle-trim=0". Empty lines and
+// lines starting with '#' are ignored. Options are:
+//
+//   frame-sync=0|1            Sync requests and frame drawn messages (X11)
+//   idle-trim=0|1             Release buffers of idle surfaces
+//   copy=damage|full          Copy damaged areas or whole buffers
+//   pacing=auto|fifo|mailbox  Forward every commit, the default, or only
+//                             the latest one per host frame, shortly
+//                             before the predicted host repaint
+//   queue-depth=N             Intermediate buffers kept per surface, 0 for
+//                             no limit
+//   coalesce-input=0|1        Merge pointer motion within a dispatch
+//   shm-driver=NAME           Driver to use, see --shm-driver
+//
+// The shm driver is chosen once per process, so it only applies to the
+// profile matching the forced application ID. Contents are copied at the
+// client's resolution, as every driver maps intermediate buffers 1:1 and
+// scaling is left to the host through the viewport.
+void sl_profiles_load(struct sl_context* ctx, const char* path) {
+  char line[1024];
+  int line_number = 0;
+  FILE* file;
+
+  file = fopen(path, "r");
+  if (!file)
+    return;
+
+  while (fgets(line, sizeof(line), file)) {
+    struct sl_profile* profile;
+    char* saveptr;
+    char* match;
+    char* option;
+
+    ++line_number;
+    match = strtok_r(line, " \t\n", &saveptr);
+    if (!match || match[0] == '#')
+      continue;
+
+    profile = malloc(sizeof(*profile));
+    assert(profile);
+    profile->match = strdup(match);
+    profile->frame_sync = 1;
+    profile->idle_trim = 1;
+    profile->copy_full = 0;
+    profile->pacing = PACING_AUTO;
+    profile->queue_depth = 0;
+    profile->coalesce_input = 0;
+    profile->shm_driver = NULL;
+
+    while ((option = strtok_r(NULL, " \t\n", &saveptr))) {
+      if (!sl_profile_set_option(profile, option)) {
+        fprintf(stderr, "error: %s:%d: invalid profile option: %s\n", path,
+                line_number, option);
+      }
+    }
+
+    wl_list_insert(ctx->profiles.prev, &profile->link);
+  }
+  fclose(file);
+}
+
+// Returns the first profile that matches |app_id|, or NULL if none does.
+// The forced application ID takes precedence, as it does when the ID is
+// sent to the host.
+struct sl_profile* sl_profile_find(struct sl_context* ctx,
+                                   const char* app_id) {
+  const char* id = ctx->application_id ? ctx->application_id : app_id;
+  struct sl_profile* profile;
+
+  if (!id)
+    return NULL;
+
+  wl_list_for_each(profile, &ctx->profiles, link) {
+    if (!strcmp(profile->match, id))
+      return profile;
+  }
+
+  return NULL;
+}
+
+// Applies the surface options of |profile|, or the defaults if NULL.
+void sl_profile_apply(struct sl_profile* profile,
+                      struct sl_host_surface* host_surface) {
+  host_surface->idle_trim = !profile || profile->idle_trim;
+  host_surface->pacing = profile ? profile->pacing : PACING_AUTO;
+  host_surface->queue_depth = profile ? profile->queue_depth : 0;
+  host_surface->coalesce_input = profile && profile->coalesce_input;
+
+  // Surfaces that fell back to full copies after a failed verify keep
+  // doing so.
+  if (profile && profile->copy_full)
+    host_surface->copy_full = 1;
+}
@@ -52,7 +52,7 @@ static void sl_host_pointer_set_cursor(struct wl_client* client,
     host_surface = wl_resource_get_user_data(surface_resource);
     host_surface->has_role = 1;
     if (host_surface->contents_width && host_surface->contents_height)
-      wl_surface_commit(host_surface->proxy);
+      sl_host_surface_forward_commit(host_surface);
   }
 
   wl_pointer_set_cursor(host->proxy, serial,
@@ -76,6 +76,35 @@ static void sl_set_last_event_serial(struct wl_resource* surface_resource,
   host_surface->last_event_serial = serial;
 }
 
+// Sends motion held back by a surface that coalesces input, along with the
+// frame that ended it.
+static void sl_pointer_flush_motion(struct sl_host_pointer* host) {
+  double scale = host->seat->ctx->scale;
+
+  if (host->motion_idle_source) {
+    wl_event_source_remove(host->motion_idle_source);
+    host->motion_idle_source = NULL;
+  }
+
+  if (!host->motion_pending)
+    return;
+
+  wl_pointer_send_motion(host->resource, host->motion_time,
+                         host->motion_x * scale, host->motion_y * scale);
+  if (host->motion_frame_pending)
+    wl_pointer_send_frame(host->resource);
+  sl_stats_input_event(host->seat->ctx, host->focus_resource);
+  host->motion_pending = 0;
+  host->motion_frame_pending = 0;
+}
+
+static void sl_pointer_motion_idle(void* data) {
+  struct sl_host_pointer* host = (struct sl_host_pointer*)data;
+
+  host->motion_idle_source = NULL;
+  sl_pointer_flush_motion(host);
+}
+
 static void sl_pointer_set_focus(struct sl_host_pointer* host,
                                  uint32_t serial,
                                  struct sl_host_surface* host_surface,
@@ -87,6 +116,7 @@ static void sl_pointer_set_focus(struct sl_host_pointer* host,
   if (surface_resource == host->focus_resource)
     return;
 
+  sl_pointer_flush_motion(host);
   if (host->focus_resource)
     wl_pointer_send_leave(host->resource, serial, host->focus_resource);
 
@@ -147,9 +177,30 @@ static void sl_pointer_motion(void* data,
                               wl_fixed_t x,
                               wl_fixed_t y) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
+  struct sl_host_surface* host_surface =
+      host->focus_resource ? wl_resource_get_user_data(host->focus_resource)
+                           : NULL;
   double scale = host->seat->ctx->scale;
 
+  // Surfaces that coalesce input only get the last motion of each batch of
+  // host events.
+  if (host_surface && host_surface->coalesce_input) {
+    host->motion_time = time;
+    host->motion_x = x;
+    host->motion_y = y;
+    host->motion_pending = 1;
+    host->motion_frame_pending = 0;
+    if (!host->motion_idle_source) {
+      host->motion_idle_source = wl_event_loop_add_idle(
+          wl_display_get_event_loop(host->seat->ctx->host_display),
+          sl_pointer_motion_idle, host);
+    }
+    return;
+  }
+
+  sl_pointer_flush_motion(host);
   wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
+  sl_stats_input_event(host->seat->ctx, host->focus_resource);
 }
 
 static void sl_pointer_button(void* data,
@@ -160,7 +211,9 @@ static void sl_pointer_button(void* data,
                               uint32_t state) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_flush_motion(host);
   wl_pointer_send_button(host->resource, serial, time, button, state);
+  sl_stats_input_event(host->seat->ctx, host->focus_resource);
 
   if (host->focus_resource)
     sl_set_last_event_serial(host->focus_resource, serial);
@@ -175,12 +228,21 @@ static void sl_pointer_axis(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
+  sl_pointer_flush_motion(host);
   wl_pointer_send_axis(host->resource, time, axis, value * scale);
+  sl_stats_input_event(host->seat->ctx, host->focus_resource);
 }
 
 static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  // A frame that only holds coalesced motion is sent along with it.
+  if (host->motion_pending && !host->motion_frame_pending) {
+    host->motion_frame_pending = 1;
+    return;
+  }
+
+  sl_pointer_flush_motion(host);
   wl_pointer_send_frame(host->resource);
 }
 
@@ -189,6 +251,7 @@ void sl_pointer_axis_source(void* data,
                             uint32_t axis_source) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_flush_motion(host);
   wl_pointer_send_axis_source(host->resource, axis_source);
 }
 
@@ -198,6 +261,7 @@ static void sl_pointer_axis_stop(void* data,
                                  uint32_t axis) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_flush_motion(host);
   wl_pointer_send_axis_stop(host->resource, time, axis);
 }
 
@@ -207,6 +271,7 @@ static void sl_pointer_axis_discrete(void* data,
                                      int32_t discrete) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_flush_motion(host);
   wl_pointer_send_axis_discrete(host->resource, axis, discrete);
 }
 
@@ -388,6 +453,9 @@ static void sl_keyboard_key(void* data,
       wl_keyboard_send_key(host->resource, serial, time, key, state);
   }
 
+  if (handled)
+    sl_stats_input_event(host->seat->ctx, host->focus_resource);
+
   if (host->focus_resource)
     sl_set_last_event_serial(host->focus_resource, serial);
   host->seat->last_serial = serial;
@@ -487,6 +555,7 @@ static void sl_host_touch_down(void* data,
 
   wl_touch_send_down(host->resource, serial, time, host_surface->resource, id,
                      x * scale, y * scale);
+  sl_stats_input_event(host->seat->ctx, host->focus_resource);
 
   if (host->focus_resource)
     sl_set_last_event_serial(host->focus_resource, serial);
@@ -521,6 +590,7 @@ static void sl_host_touch_motion(void* data,
   double scale = host->seat->ctx->scale;
 
   wl_touch_send_motion(host->resource, time, id, x * scale, y * scale);
+  sl_stats_input_event(host->seat->ctx, host->focus_resource);
 }
 
 static void sl_host_touch_frame(void* data, struct wl_touch* touch) {
@@ -547,6 +617,8 @@ static void sl_destroy_host_pointer(struct wl_resource* resource) {
   } else {
     wl_pointer_destroy(host->proxy);
   }
+  if (host->motion_idle_source)
+    wl_event_source_remove(host->motion_idle_source);
   wl_list_remove(&host->focus_resource_listener.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
@@ -584,6 +656,9 @@ static void sl_host_seat_get_host_pointer(struct wl_client* client,
       sl_pointer_focus_resource_destroyed;
   host_pointer->focus_resource = NULL;
   host_pointer->focus_serial = 0;
+  host_pointer->motion_idle_source = NULL;
+  host_pointer->motion_pending = 0;
+  host_pointer->motion_frame_pending = 0;
 }
 
 static void sl_destroy_host_keyboard(struct wl_resource* resource) {
@@ -5,7 +5,10 @@
 #include "sommelier.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
@@ -131,8 +134,10 @@ static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 uint32_t format) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
-  if (host->shm->ctx->shm_driver == SHM_DRIVER_NOOP) {
-    assert(host->proxy);
+  // Pools forwarded in hybrid mode also keep their fd so that buffers in
+  // formats the host wl_shm might not support can still be copied.
+  if (host->proxy && (host->fd < 0 || format == WL_SHM_FORMAT_ARGB8888 ||
+                      format == WL_SHM_FORMAT_XRGB8888)) {
     sl_create_host_buffer(client, id,
                           wl_shm_pool_create_buffer(host->proxy, offset, width,
                                                     height, stride, format),
@@ -182,6 +187,31 @@ static void sl_destroy_host_shm_pool(struct wl_resource* resource) {
   free(host);
 }
 
+// Returns true if the host compositor can map the pool fd directly. That
+// is the case for memfds and files on tmpfs when the host connection is a
+// plain socket. A virtwl context can only transfer fds allocated by the
+// virtwl device, which show up as anonymous inodes named after it.
+static int sl_shm_pool_fd_is_shareable(struct sl_context* ctx, int fd) {
+  char path[32], target[64];
+  struct stat st;
+  ssize_t len;
+
+  if (ctx->virtwl_socket_fd == -1) {
+    if (fstat(fd, &st))
+      return 0;
+
+    return S_ISREG(st.st_mode);
+  }
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  len = readlink(path, target, sizeof(target) - 1);
+  if (len < 0)
+    return 0;
+
+  target[len] = '\0';
+  return strstr(target, "anon_inode:[virtwl") == target;
+}
+
 static void sl_shm_create_host_pool(struct wl_client* client,
                                     struct wl_resource* resource,
                                     uint32_t id,
@@ -211,6 +241,14 @@ static void sl_shm_create_host_pool(struct wl_client* client,
     case SHM_DRIVER_DMABUF:
     case SHM_DRIVER_VIRTWL:
     case SHM_DRIVER_VIRTWL_DMABUF:
+    case SHM_DRIVER_STREAM:
+      // The stream driver is for hosts that can't map any memory.
+      if (host->shm->ctx->shm_hybrid &&
+          host->shm->ctx->shm_driver != SHM_DRIVER_STREAM &&
+          sl_shm_pool_fd_is_shareable(host->shm->ctx, fd)) {
+        host_shm_pool->proxy = wl_shm_create_pool(host->shm_proxy, fd, size);
+        wl_shm_pool_set_user_data(host_shm_pool->proxy, host_shm_pool);
+      }
       host_shm_pool->fd = fd;
       break;
   }
@@ -304,6 +342,7 @@ static void sl_bind_host_shm(struct wl_client* client,
   switch (ctx->shm_driver) {
     case SHM_DRIVER_NOOP:
     case SHM_DRIVER_VIRTWL:
+    case SHM_DRIVER_STREAM:
       host->shm_proxy = wl_registry_bind(
           wl_display_get_registry(ctx->display), ctx->shm->id,
           &wl_shm_interface, wl_resource_get_version(host->resource));
@@ -320,6 +359,14 @@ static void sl_bind_host_shm(struct wl_client* client,
       zwp_linux_dmabuf_v1_set_user_data(host->linux_dmabuf_proxy, host);
       zwp_linux_dmabuf_v1_add_listener(host->linux_dmabuf_proxy,
                                        &sl_linux_dmabuf_listener, host);
+      // Hybrid pools are forwarded through a per-client wl_shm. Formats are
+      // still advertised from linux_dmabuf, so no listener is needed.
+      if (ctx->shm_hybrid) {
+        host->shm_proxy = wl_registry_bind(
+            wl_display_get_registry(ctx->display), ctx->shm->id,
+            &wl_shm_interface, wl_resource_get_version(host->resource));
+        wl_shm_set_user_data(host->shm_proxy, host);
+      }
       break;
   }
 }
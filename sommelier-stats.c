@@ -0,0 +1,345 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+uint64_t sl_now_us(void) {
+  struct timespec ts;
+  int rv;
+
+  rv = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(!rv);
+  UNUSED(rv);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sl_histogram_init(struct sl_histogram* histogram, const char* name) {
+  memset(histogram, 0, sizeof(*histogram));
+  histogram->name = name;
+}
+
+void sl_histogram_add(struct sl_histogram* histogram, uint64_t value) {
+  size_t bucket = 0;
+
+  // Bucket N holds values in the range [2^(N-1), 2^N).
+  while (bucket < SL_HISTOGRAM_BUCKETS - 1 && (value >> bucket))
+    ++bucket;
+
+  if (!histogram->count || value < histogram->min)
+    histogram->min = value;
+  if (value > histogram->max)
+    histogram->max = value;
+  histogram->sum += value;
+  histogram->count++;
+  histogram->buckets[bucket]++;
+}
+
+// Returns the upper bound of the bucket that holds the given percentile,
+// clamped to the largest value seen.
+static uint64_t sl_histogram_percentile(struct sl_histogram* histogram,
+                                        int percentile) {
+  uint64_t target = (histogram->count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  size_t i;
+
+  for (i = 0; i < SL_HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram->buckets[i];
+    if (seen >= target)
+      return MIN((uint64_t)1 << i, histogram->max);
+  }
+
+  return histogram->max;
+}
+
+static void sl_histogram_report(struct sl_histogram* histogram,
+                                uint32_t surface_id) {
+  if (!histogram->count)
+    return;
+
+  fprintf(stderr, "stats: %s:", histogram->name);
+  if (surface_id)
+    fprintf(stderr, " surface=%u", surface_id);
+  fprintf(stderr,
+          " count=%" PRIu64 " avg=%" PRIu64 "us min=%" PRIu64
+          "us p50=%" PRIu64 "us p90=%" PRIu64 "us p99=%" PRIu64
+          "us max=%" PRIu64 "us\n",
+          histogram->count, histogram->sum / histogram->count,
+          histogram->min, sl_histogram_percentile(histogram, 50),
+          sl_histogram_percentile(histogram, 90),
+          sl_histogram_percentile(histogram, 99), histogram->max);
+  sl_histogram_init(histogram, histogram->name);
+}
+
+static const char* sl_startup_phase_names[] = {
+    [SL_STARTUP_PHASE_INIT] = "init",
+    [SL_STARTUP_PHASE_REGISTRY] = "registry",
+    [SL_STARTUP_PHASE_XWAYLAND_READY] = "xwayland-ready",
+    [SL_STARTUP_PHASE_CONNECT] = "connect",
+    [SL_STARTUP_PHASE_FIRST_COMMIT] = "first-commit",
+};
+
+static void sl_stats_report_startup(struct sl_context* ctx) {
+  int i;
+
+  fprintf(stderr, "stats: startup:");
+  for (i = 0; i <= SL_STARTUP_PHASE_LAST; ++i) {
+    // Phases that don't apply, such as Xwayland ready for a plain Wayland
+    // client, are left out.
+    if (ctx->stats.startup_phases[i]) {
+      fprintf(stderr, " %s=%" PRIu64 "us", sl_startup_phase_names[i],
+              ctx->stats.startup_phases[i] - ctx->stats.start_us);
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+static void sl_transfer_stats_init(struct sl_transfer_stats* stats,
+                                   const char* name) {
+  memset(stats, 0, sizeof(*stats));
+  stats->name = name;
+}
+
+static void sl_transfer_stats_report(struct sl_transfer_stats* stats) {
+  if (!stats->count)
+    return;
+
+  // Bytes per microsecond is the same as MB/s.
+  fprintf(stderr,
+          "stats: %s: transfers=%" PRIu64 " bytes=%" PRIu64
+          " rate=%.1fMB/s iterations-per-mb=%.1f\n",
+          stats->name, stats->count, stats->bytes,
+          stats->time_us ? (double)stats->bytes / stats->time_us : 0.0,
+          stats->bytes ? stats->iterations * 1000000.0 / stats->bytes : 0.0);
+  sl_transfer_stats_init(stats, stats->name);
+}
+
+static int sl_count_fds(void) {
+  struct dirent* entry;
+  int count = 0;
+  DIR* dir;
+
+  dir = opendir("/proc/self/fd");
+  if (!dir)
+    return -1;
+
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] != '.')
+      ++count;
+  }
+  closedir(dir);
+
+  // The directory being read holds an fd of its own.
+  return count - 1;
+}
+
+// Reports the memory footprint of this process. USS is the memory that would
+// be freed if the process exited, PSS adds its share of memory mapped by
+// other processes too, such as buffers shared with the X server or host.
+static void sl_stats_report_memory(struct sl_context* ctx) {
+  uint64_t rss_kb = 0, pss_kb = 0, uss_kb = 0;
+  char line[256];
+  FILE* file;
+
+  file = fopen("/proc/self/smaps_rollup", "r");
+  if (file) {
+    while (fgets(line, sizeof(line), file)) {
+      uint64_t value;
+
+      if (sscanf(line, "Rss: %" SCNu64, &value) == 1) {
+        rss_kb = value;
+      } else if (sscanf(line, "Pss: %" SCNu64, &value) == 1) {
+        pss_kb = value;
+      } else if (sscanf(line, "Private_Clean: %" SCNu64, &value) == 1 ||
+                 sscanf(line, "Private_Dirty: %" SCNu64, &value) == 1) {
+        uss_kb += value;
+      }
+    }
+    fclose(file);
+  }
+
+  fprintf(stderr,
+          "stats: memory: pid=%d rss=%" PRIu64 "kB pss=%" PRIu64
+          "kB uss=%" PRIu64 "kB buffers=%" PRIu64 " buffer-bytes=%" PRIu64
+          " fds=%d\n",
+          getpid(), rss_kb, pss_kb, uss_kb, ctx->stats.buffer_count,
+          ctx->stats.buffer_bytes, sl_count_fds());
+}
+
+void sl_stats_report(struct sl_context* ctx) {
+  struct sl_host_surface* host;
+
+  sl_histogram_report(&ctx->stats.input_latency, 0);
+  sl_histogram_report(&ctx->stats.present_latency, 0);
+  sl_histogram_report(&ctx->stats.map_latency, 0);
+  sl_histogram_report(&ctx->stats.host_rtt, 0);
+  if (ctx->host_probe.interval) {
+    fprintf(stderr,
+            "stats: host-link: rtt=%" PRIu64 "us jitter=%" PRIu64
+            "us slow=%d\n",
+            ctx->host_probe.rtt_us, ctx->host_probe.jitter_us,
+            ctx->host_probe.slow);
+  }
+  wl_list_for_each(host, &ctx->surfaces, link) {
+    if (!host->frame_interval.count)
+      continue;
+
+    fprintf(stderr,
+            "stats: pacing: surface=%u latency=%" PRIu64 "us frames=%s\n",
+            host->id, host->frame_latency_us,
+            sl_host_surface_mailbox(host) ? "mailbox" : "fifo");
+    sl_histogram_report(&host->frame_interval, host->id);
+  }
+  if (ctx->stats.x_events) {
+    fprintf(stderr,
+            "stats: x-events: count=%" PRIu64 " compressed=%" PRIu64 "\n",
+            ctx->stats.x_events, ctx->stats.x_events_compressed);
+    ctx->stats.x_events = 0;
+    ctx->stats.x_events_compressed = 0;
+  }
+  sl_perf_report(ctx);
+  sl_transfer_stats_report(&ctx->stats.x11_to_wayland);
+  sl_transfer_stats_report(&ctx->stats.wayland_to_x11);
+  sl_transfer_stats_report(&ctx->stats.wayland_to_wayland);
+  sl_stats_report_memory(ctx);
+}
+
+static int sl_handle_stats_timer(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  sl_stats_report(ctx);
+  wl_event_source_timer_update(ctx->stats.timer_event_source,
+                               ctx->stats.interval * 1000);
+  return 0;
+}
+
+void sl_stats_init(struct sl_context* ctx, int interval) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+
+  // Phases are measured from the start of the process, which main() records
+  // before doing anything else.
+  ctx->stats.interval = interval;
+  sl_stats_startup_phase(ctx, SL_STARTUP_PHASE_INIT);
+  sl_histogram_init(&ctx->stats.input_latency, "input-latency");
+  sl_histogram_init(&ctx->stats.present_latency, "present-latency");
+  sl_histogram_init(&ctx->stats.map_latency, "map-latency");
+  sl_histogram_init(&ctx->stats.host_rtt, "host-rtt");
+  sl_transfer_stats_init(&ctx->stats.x11_to_wayland,
+                         "clipboard-x11-to-wayland");
+  sl_transfer_stats_init(&ctx->stats.wayland_to_x11,
+                         "clipboard-wayland-to-x11");
+  sl_transfer_stats_init(&ctx->stats.wayland_to_wayland, "data-transfer");
+
+  ctx->stats.timer_event_source =
+      wl_event_loop_add_timer(event_loop, sl_handle_stats_timer, ctx);
+  wl_event_source_timer_update(ctx->stats.timer_event_source, interval * 1000);
+}
+
+static void sl_stats_registry_done(void* data,
+                                   struct wl_callback* callback,
+                                   uint32_t serial) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  sl_stats_startup_phase(ctx, SL_STARTUP_PHASE_REGISTRY);
+  wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener sl_stats_registry_listener = {
+    sl_stats_registry_done};
+
+void sl_stats_watch_registry(struct sl_context* ctx) {
+  struct wl_callback* callback;
+
+  if (!ctx->stats.interval)
+    return;
+
+  // The initial burst of globals has been received and handled once the
+  // host responds to a sync request sent after getting the registry.
+  callback = wl_display_sync(ctx->display);
+  wl_callback_add_listener(callback, &sl_stats_registry_listener, ctx);
+}
+
+void sl_stats_startup_phase(struct sl_context* ctx, int phase) {
+  if (!ctx->stats.interval || ctx->stats.startup_phases[phase])
+    return;
+
+  ctx->stats.startup_phases[phase] = sl_now_us();
+  if (phase == SL_STARTUP_PHASE_FIRST_COMMIT)
+    sl_stats_report_startup(ctx);
+}
+
+void sl_stats_input_event(struct sl_context* ctx,
+                          struct wl_resource* surface_resource) {
+  struct sl_host_surface* host_surface;
+
+  if (!ctx->stats.interval || !surface_resource)
+    return;
+
+  // Only the oldest input event that has not yet been followed by a commit
+  // is tracked. Latency is measured from it to the next commit.
+  host_surface = wl_resource_get_user_data(surface_resource);
+  if (!host_surface->input_time_us)
+    host_surface->input_time_us = sl_now_us();
+}
+
+void sl_stats_surface_commit(struct sl_host_surface* host_surface) {
+  struct sl_context* ctx = host_surface->ctx;
+
+  if (host_surface->contents_width && host_surface->contents_height)
+    sl_stats_startup_phase(ctx, SL_STARTUP_PHASE_FIRST_COMMIT);
+
+  if (!host_surface->input_time_us)
+    return;
+
+  sl_histogram_add(&ctx->stats.input_latency,
+                   sl_now_us() - host_surface->input_time_us);
+  host_surface->input_time_us = 0;
+}
+
+void sl_stats_window_realized(struct sl_window* window) {
+  struct sl_context* ctx = window->ctx;
+
+  // Measured from when the window was mapped on the X side to the first
+  // commit with contents after the host surface got its role.
+  if (!window->map_us)
+    return;
+
+  sl_histogram_add(&ctx->stats.map_latency, sl_now_us() - window->map_us);
+  window->map_us = 0;
+}
+
+void sl_transfer_begin(struct sl_context* ctx, struct sl_transfer* transfer) {
+  transfer->start_us = ctx->stats.interval ? sl_now_us() : 0;
+  transfer->bytes = 0;
+  transfer->iterations = 0;
+}
+
+void sl_transfer_progress(struct sl_transfer* transfer, ssize_t bytes) {
+  transfer->iterations++;
+  if (bytes > 0)
+    transfer->bytes += bytes;
+}
+
+void sl_transfer_end(struct sl_context* ctx,
+                     struct sl_transfer_stats* stats,
+                     struct sl_transfer* transfer) {
+  if (!transfer->start_us)
+    return;
+
+  stats->count++;
+  stats->bytes += transfer->bytes;
+  stats->iterations += transfer->iterations;
+  stats->time_us += sl_now_us() - transfer->start_us;
+  transfer->start_us = 0;
+}
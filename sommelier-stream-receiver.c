@@ -0,0 +1,251 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-stream.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STREAM_RECEIVER_READ_SIZE 65536
+
+void sl_stream_receiver_init(struct sl_stream_receiver* receiver,
+                             int fd,
+                             sl_stream_commit_func_t commit,
+                             void* data) {
+  memset(receiver, 0, sizeof(*receiver));
+  receiver->fd = fd;
+  receiver->commit = commit;
+  receiver->data = data;
+}
+
+static struct sl_stream_received_buffer* sl_stream_receiver_lookup(
+    struct sl_stream_receiver* receiver, uint32_t buffer_id) {
+  struct sl_stream_received_buffer* buffer;
+
+  for (buffer = receiver->buffers; buffer; buffer = buffer->next) {
+    if (buffer->info.buffer_id == buffer_id)
+      return buffer;
+  }
+
+  return NULL;
+}
+
+// Expands PackBits encoded |src| into exactly |size| bytes at |dst|.
+// Returns 0 if the data doesn't expand to that size.
+static int sl_stream_unpack(uint8_t* dst,
+                            size_t size,
+                            const uint8_t* src,
+                            size_t src_size) {
+  const uint8_t* end = src + src_size;
+  size_t out = 0;
+
+  while (src < end) {
+    uint8_t control = *src++;
+
+    if (control < 128) {
+      size_t literal = control + 1;
+
+      if (end - src < (ptrdiff_t)literal || size - out < literal)
+        return 0;
+      memcpy(dst + out, src, literal);
+      src += literal;
+      out += literal;
+    } else if (control > 128) {
+      size_t run = 257 - control;
+
+      if (src == end || size - out < run)
+        return 0;
+      memset(dst + out, *src++, run);
+      out += run;
+    }
+  }
+
+  return out == size;
+}
+
+static int sl_stream_receiver_damage(struct sl_stream_receiver* receiver,
+                                     const struct sl_stream_damage* message,
+                                     const uint8_t* data,
+                                     size_t data_size) {
+  struct sl_stream_received_buffer* buffer =
+      sl_stream_receiver_lookup(receiver, message->buffer_id);
+  size_t size = (size_t)message->row_bytes * message->rows;
+  const uint8_t* src;
+  uint8_t* dst;
+  size_t y, x;
+
+  if (!buffer || message->size != data_size)
+    return 0;
+  if (!message->rows || !message->row_bytes)
+    return 1;
+
+  // Every row has to be inside the buffer.
+  if (message->row_bytes > message->stride && message->rows > 1)
+    return 0;
+  if ((size_t)message->offset +
+          (size_t)(message->rows - 1) * message->stride +
+          message->row_bytes >
+      buffer->info.size) {
+    return 0;
+  }
+
+  if (receiver->scratch_size < size) {
+    free(receiver->scratch);
+    receiver->scratch = malloc(size);
+    assert(receiver->scratch);
+    receiver->scratch_size = size;
+  }
+  if (!sl_stream_unpack(receiver->scratch, size, data, data_size))
+    return 0;
+
+  src = receiver->scratch;
+  dst = buffer->data + message->offset;
+  for (y = 0; y < message->rows; ++y) {
+    if (message->flags & SL_STREAM_DAMAGE_DELTA) {
+      for (x = 0; x < message->row_bytes; ++x)
+        dst[x] ^= src[x];
+    } else {
+      memcpy(dst, src, message->row_bytes);
+    }
+    src += message->row_bytes;
+    dst += message->stride;
+  }
+
+  return 1;
+}
+
+// Applies one message. Returns 0 if it is malformed.
+static int sl_stream_receiver_handle(struct sl_stream_receiver* receiver,
+                                     uint32_t type,
+                                     const uint8_t* payload,
+                                     size_t size) {
+  switch (type) {
+    case SL_STREAM_BUFFER_CREATE: {
+      struct sl_stream_received_buffer* buffer;
+
+      if (size != sizeof(struct sl_stream_buffer_create))
+        return 0;
+
+      buffer = malloc(sizeof(*buffer));
+      assert(buffer);
+      memcpy(&buffer->info, payload, sizeof(buffer->info));
+      buffer->data = calloc(1, buffer->info.size);
+      assert(buffer->data || !buffer->info.size);
+      buffer->next = receiver->buffers;
+      receiver->buffers = buffer;
+    } break;
+    case SL_STREAM_BUFFER_DESTROY: {
+      struct sl_stream_received_buffer** link = &receiver->buffers;
+      struct sl_stream_buffer_destroy message;
+
+      if (size != sizeof(message))
+        return 0;
+      memcpy(&message, payload, sizeof(message));
+
+      while (*link && (*link)->info.buffer_id != message.buffer_id)
+        link = &(*link)->next;
+      if (*link) {
+        struct sl_stream_received_buffer* buffer = *link;
+
+        *link = buffer->next;
+        free(buffer->data);
+        free(buffer);
+      }
+    } break;
+    case SL_STREAM_DAMAGE: {
+      struct sl_stream_damage message;
+
+      if (size < sizeof(message))
+        return 0;
+      memcpy(&message, payload, sizeof(message));
+      return sl_stream_receiver_damage(receiver, &message,
+                                       payload + sizeof(message),
+                                       size - sizeof(message));
+    }
+    case SL_STREAM_COMMIT: {
+      struct sl_stream_received_buffer* buffer;
+      struct sl_stream_commit message;
+
+      if (size != sizeof(message))
+        return 0;
+      memcpy(&message, payload, sizeof(message));
+
+      buffer = sl_stream_receiver_lookup(receiver, message.buffer_id);
+      if (!buffer)
+        return 0;
+      if (receiver->commit)
+        receiver->commit(receiver->data, message.surface_id, buffer);
+    } break;
+    default:
+      // Unknown messages are skipped so that new ones can be added.
+      break;
+  }
+
+  return 1;
+}
+
+// Reads what is available on the stream and applies all complete messages.
+// Returns 1 if the stream is still open, 0 when it has been closed and -1
+// on errors, including malformed messages.
+int sl_stream_receiver_dispatch(struct sl_stream_receiver* receiver) {
+  size_t offset = 0;
+  ssize_t bytes;
+
+  if (receiver->input_capacity - receiver->input_size <
+      STREAM_RECEIVER_READ_SIZE) {
+    receiver->input_capacity =
+        receiver->input_size + STREAM_RECEIVER_READ_SIZE;
+    receiver->input = realloc(receiver->input, receiver->input_capacity);
+    assert(receiver->input);
+  }
+
+  do {
+    bytes = read(receiver->fd, receiver->input + receiver->input_size,
+                 receiver->input_capacity - receiver->input_size);
+  } while (bytes < 0 && errno == EINTR);
+
+  if (bytes < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+  receiver->input_size += bytes;
+
+  while (receiver->input_size - offset >= sizeof(struct sl_stream_header)) {
+    struct sl_stream_header header;
+
+    memcpy(&header, receiver->input + offset, sizeof(header));
+    if (receiver->input_size - offset - sizeof(header) < header.size)
+      break;
+
+    if (!sl_stream_receiver_handle(receiver, header.type,
+                                   receiver->input + offset + sizeof(header),
+                                   header.size)) {
+      fprintf(stderr, "error: malformed damage stream message %u\n",
+              header.type);
+      return -1;
+    }
+    offset += sizeof(header) + header.size;
+  }
+
+  // Keep the start of an incomplete message for the next read.
+  memmove(receiver->input, receiver->input + offset,
+          receiver->input_size - offset);
+  receiver->input_size -= offset;
+
+  return bytes ? 1 : 0;
+}
+
+void sl_stream_receiver_fini(struct sl_stream_receiver* receiver) {
+  while (receiver->buffers) {
+    struct sl_stream_received_buffer* buffer = receiver->buffers;
+
+    receiver->buffers = buffer->next;
+    free(buffer->data);
+    free(buffer);
+  }
+  free(receiver->input);
+  free(receiver->scratch);
+}
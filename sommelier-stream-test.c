@@ -0,0 +1,178 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Round trip test for the damage stream. Contents are written through the
+// same functions as the copy path uses and reconstructed by the receiver on
+// the other end of a socketpair.
+
+#include "sommelier.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sommelier-stream.h"
+
+#define TEST_SURFACE_ID 7
+
+struct test_state {
+  int commits;
+  uint32_t surface_id;
+  struct sl_stream_received_buffer* buffer;
+};
+
+struct test_waiter {
+  struct sl_stream_waiter waiter;
+  int done;
+};
+
+static void test_waiter_done(struct sl_stream_waiter* waiter) {
+  struct test_waiter* test_waiter =
+      wl_container_of(waiter, test_waiter, waiter);
+
+  test_waiter->done = 1;
+}
+
+static void test_commit(void* data,
+                        uint32_t surface_id,
+                        struct sl_stream_received_buffer* buffer) {
+  struct test_state* state = (struct test_state*)data;
+
+  state->commits++;
+  state->surface_id = surface_id;
+  state->buffer = buffer;
+}
+
+// Runs both ends until the receiver has seen |commits| commits.
+static int test_pump(struct sl_context* ctx,
+                     struct sl_stream_receiver* receiver,
+                     struct test_state* state,
+                     int commits) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+
+  while (state->commits < commits) {
+    wl_event_loop_dispatch(event_loop, 0);
+    if (sl_stream_receiver_dispatch(receiver) < 0)
+      return 0;
+  }
+
+  return ctx->stream.fd >= 0;
+}
+
+// Writes damage for a rectangle of |src| and copies it to |dst| the way
+// the copy path does.
+static void test_damage(struct sl_context* ctx,
+                        uint32_t buffer_id,
+                        uint8_t* dst,
+                        const uint8_t* src,
+                        size_t stride,
+                        size_t x,
+                        size_t y,
+                        size_t width,
+                        size_t height,
+                        int delta) {
+  size_t offset = y * stride + x * 4;
+  size_t i;
+
+  sl_stream_damage(ctx, buffer_id, dst, dst + offset, stride,
+                   (uint8_t*)src + offset, stride, width * 4, height, delta);
+  for (i = 0; i < height; ++i) {
+    memcpy(dst + offset + i * stride, src + offset + i * stride, width * 4);
+  }
+}
+
+static int test_round_trip(size_t width, size_t height) {
+  struct sl_context ctx;
+  struct sl_stream_receiver receiver;
+  struct test_state state = {0};
+  struct test_waiter waiter = {.waiter = {.done = test_waiter_done}};
+  size_t stride = width * 4;
+  size_t size = stride * height;
+  uint8_t* src = malloc(size);
+  uint8_t* dst = calloc(1, size);
+  struct sl_mmap map;
+  uint32_t buffer_id;
+  int result = 1;
+  int sv[2];
+  size_t i;
+
+  if (!src || !dst || socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    return 0;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.host_display = wl_display_create();
+  sl_stream_init(&ctx, sv[0]);
+  fcntl(sv[1], F_SETFL, O_NONBLOCK);
+  sl_stream_receiver_init(&receiver, sv[1], test_commit, &state);
+
+  memset(&map, 0, sizeof(map));
+  map.addr = dst;
+  map.size = size;
+  map.bpp = 4;
+  map.num_planes = 1;
+  map.stride[0] = stride;
+  map.y_ss[0] = 1;
+  buffer_id = sl_stream_buffer_create(&ctx, width, height, 0, &map);
+
+  // The first frame is sent in full.
+  for (i = 0; i < size; ++i)
+    src[i] = (i * 7) ^ (i >> 9);
+  test_damage(&ctx, buffer_id, dst, src, stride, 0, 0, width, height, 0);
+  sl_stream_commit(&ctx, TEST_SURFACE_ID, buffer_id);
+  if (!test_pump(&ctx, &receiver, &state, 1) ||
+      state.surface_id != TEST_SURFACE_ID ||
+      memcmp(state.buffer->data, src, size)) {
+    fprintf(stderr, "stream test: full frame %zux%zu mismatch\n", width,
+            height);
+    result = 0;
+  }
+
+  // The second frame only sends the changed rectangle, delta encoded.
+  for (i = 0; i < height / 2; ++i)
+    memset(src + (height / 4 + i) * stride + stride / 4, 0x5a, stride / 2);
+  test_damage(&ctx, buffer_id, dst, src, stride, width / 4, height / 4,
+              width / 2, height / 2, 1);
+  sl_stream_commit(&ctx, TEST_SURFACE_ID, buffer_id);
+  sl_stream_wait(&ctx, &waiter.waiter);
+  if (!test_pump(&ctx, &receiver, &state, 2) ||
+      memcmp(state.buffer->data, src, size)) {
+    fprintf(stderr, "stream test: delta frame %zux%zu mismatch\n", width,
+            height);
+    result = 0;
+  }
+
+  // Waiters are done once everything queued before them has been written.
+  wl_event_loop_dispatch(wl_display_get_event_loop(ctx.host_display), 0);
+  if (!waiter.done) {
+    fprintf(stderr, "stream test: waiter %zux%zu not done\n", width,
+            height);
+    result = 0;
+  }
+
+  sl_stream_buffer_destroy(&ctx, buffer_id);
+  sl_stream_receiver_fini(&receiver);
+  close(sv[1]);
+  if (ctx.stream.fd >= 0) {
+    wl_event_source_remove(ctx.stream.event_source);
+    close(ctx.stream.fd);
+  }
+  wl_display_destroy(ctx.host_display);
+  free(src);
+  free(dst);
+
+  return result;
+}
+
+int main(int argc, char** argv) {
+  // The large size doesn't fit in the socket buffer, so writes are queued
+  // and flushed from the event loop.
+  if (!test_round_trip(64, 32) || !test_round_trip(1024, 1024))
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
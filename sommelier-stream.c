@@ -0,0 +1,316 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sommelier-stream.h"
+
+// Commits are dropped while more than this is queued, which keeps memory
+// bounded when the receiver falls behind.
+#define STREAM_QUEUE_LIMIT (64 * 1024 * 1024)
+
+// Completes waiters for data that has been written. All of them complete
+// once the stream is closed.
+static void sl_stream_idle(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  ctx->stream.idle_event_source = NULL;
+  while (!wl_list_empty(&ctx->stream.waiters)) {
+    struct sl_stream_waiter* waiter =
+        wl_container_of(ctx->stream.waiters.next, waiter, link);
+
+    if (ctx->stream.fd >= 0 && waiter->position > ctx->stream.written)
+      break;
+
+    wl_list_remove(&waiter->link);
+    wl_list_init(&waiter->link);
+    waiter->done(waiter);
+  }
+}
+
+// Waiters are completed from an idle callback, as the stream is written
+// while surface state is being updated.
+static void sl_stream_schedule_waiters(struct sl_context* ctx) {
+  struct sl_stream_waiter* waiter;
+
+  if (ctx->stream.idle_event_source || wl_list_empty(&ctx->stream.waiters))
+    return;
+
+  waiter = wl_container_of(ctx->stream.waiters.next, waiter, link);
+  if (ctx->stream.fd >= 0 && waiter->position > ctx->stream.written)
+    return;
+
+  ctx->stream.idle_event_source = wl_event_loop_add_idle(
+      wl_display_get_event_loop(ctx->host_display), sl_stream_idle, ctx);
+}
+
+static void sl_stream_close(struct sl_context* ctx) {
+  if (ctx->stream.event_source)
+    wl_event_source_remove(ctx->stream.event_source);
+  ctx->stream.event_source = NULL;
+  close(ctx->stream.fd);
+  ctx->stream.fd = -1;
+  ctx->stream.queue_size = 0;
+  sl_stream_schedule_waiters(ctx);
+}
+
+// Writes as much of the queue as the stream accepts without blocking.
+static void sl_stream_flush(struct sl_context* ctx) {
+  size_t offset = 0;
+
+  while (offset < ctx->stream.queue_size) {
+    ssize_t bytes = write(ctx->stream.fd, ctx->stream.queue + offset,
+                          ctx->stream.queue_size - offset);
+
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      fprintf(stderr, "error: damage stream write failed: %s\n",
+              strerror(errno));
+      sl_stream_close(ctx);
+      return;
+    }
+    offset += bytes;
+  }
+
+  memmove(ctx->stream.queue, ctx->stream.queue + offset,
+          ctx->stream.queue_size - offset);
+  ctx->stream.queue_size -= offset;
+  ctx->stream.written += offset;
+
+  if (ctx->stream.event_source) {
+    wl_event_source_fd_update(ctx->stream.event_source,
+                              ctx->stream.queue_size ? WL_EVENT_WRITABLE : 0);
+  }
+  sl_stream_schedule_waiters(ctx);
+}
+
+static int sl_handle_stream_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) {
+    fprintf(stderr, "error: damage stream closed\n");
+    sl_stream_close(ctx);
+    return 0;
+  }
+
+  sl_stream_flush(ctx);
+  return 0;
+}
+
+static void sl_stream_write(struct sl_context* ctx,
+                            uint32_t type,
+                            const void* message,
+                            size_t message_size,
+                            const void* data,
+                            size_t data_size) {
+  struct sl_stream_header header = {type, message_size + data_size};
+  const void* parts[] = {&header, message, data};
+  size_t sizes[] = {sizeof(header), message_size, data_size};
+  size_t size = sizeof(header) + message_size + data_size;
+  size_t i;
+
+  if (ctx->stream.fd < 0)
+    return;
+
+  // The receiver has to see every message that is written to reconstruct
+  // buffers, so messages are queued rather than dropped while the stream is
+  // full. Writers drop whole commits instead, see sl_stream_congested().
+  if (ctx->stream.queue_capacity - ctx->stream.queue_size < size) {
+    ctx->stream.queue_capacity =
+        MAX(ctx->stream.queue_capacity * 2, ctx->stream.queue_size + size);
+    ctx->stream.queue =
+        realloc(ctx->stream.queue, ctx->stream.queue_capacity);
+    assert(ctx->stream.queue);
+  }
+  for (i = 0; i < ARRAY_SIZE(parts); ++i) {
+    if (sizes[i]) {
+      memcpy(ctx->stream.queue + ctx->stream.queue_size, parts[i], sizes[i]);
+      ctx->stream.queue_size += sizes[i];
+    }
+  }
+
+  sl_stream_flush(ctx);
+}
+
+// PackBits: a control byte N in [0, 127] is followed by N + 1 literal bytes,
+// and N in [129, 255] is followed by one byte that repeats 257 - N times.
+static size_t sl_stream_pack(uint8_t* dst, const uint8_t* src, size_t size) {
+  uint8_t* out = dst;
+  size_t i = 0;
+
+  while (i < size) {
+    size_t run = 1;
+
+    while (i + run < size && run < 128 && src[i + run] == src[i])
+      ++run;
+
+    if (run > 1) {
+      *out++ = 257 - run;
+      *out++ = src[i];
+      i += run;
+    } else {
+      size_t literal = 1;
+
+      // Extend the literal until a run of at least three bytes starts.
+      while (i + literal < size && literal < 128 &&
+             !(i + literal + 2 < size &&
+               src[i + literal] == src[i + literal + 1] &&
+               src[i + literal] == src[i + literal + 2]))
+        ++literal;
+
+      *out++ = literal - 1;
+      memcpy(out, src + i, literal);
+      out += literal;
+      i += literal;
+    }
+  }
+
+  return out - dst;
+}
+
+static void sl_stream_reserve(struct sl_context* ctx, size_t size) {
+  // PackBits grows incompressible data by at most one byte in 128.
+  size_t packed_size = size + size / 128 + 1;
+
+  if (ctx->stream.scratch_size >= size)
+    return;
+
+  free(ctx->stream.scratch);
+  free(ctx->stream.packed);
+  ctx->stream.scratch = malloc(size);
+  assert(ctx->stream.scratch);
+  ctx->stream.packed = malloc(packed_size);
+  assert(ctx->stream.packed);
+  ctx->stream.scratch_size = size;
+}
+
+void sl_stream_init(struct sl_context* ctx, int fd) {
+  int flags = fcntl(fd, F_GETFL);
+
+  ctx->stream.fd = fd;
+  ctx->stream.next_buffer_id = 1;
+  ctx->stream.scratch = NULL;
+  ctx->stream.packed = NULL;
+  ctx->stream.scratch_size = 0;
+  ctx->stream.queue = NULL;
+  ctx->stream.queue_size = 0;
+  ctx->stream.queue_capacity = 0;
+  ctx->stream.written = 0;
+  wl_list_init(&ctx->stream.waiters);
+  ctx->stream.idle_event_source = NULL;
+
+  // Writes never block the main loop. Data the receiver isn't ready for is
+  // queued and written once the stream becomes writable.
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    fprintf(stderr, "error: damage stream: %s\n", strerror(errno));
+    ctx->stream.fd = -1;
+    return;
+  }
+  ctx->stream.event_source =
+      wl_event_loop_add_fd(wl_display_get_event_loop(ctx->host_display), fd,
+                           0, sl_handle_stream_event, ctx);
+}
+
+uint32_t sl_stream_buffer_create(struct sl_context* ctx,
+                                 uint32_t width,
+                                 uint32_t height,
+                                 uint32_t format,
+                                 struct sl_mmap* map) {
+  struct sl_stream_buffer_create message = {
+      .buffer_id = ctx->stream.next_buffer_id++,
+      .width = width,
+      .height = height,
+      .format = format,
+      .size = map->size,
+      .offset = {map->offset[0], map->offset[1]},
+      .stride = {map->stride[0], map->stride[1]}};
+
+  sl_stream_write(ctx, SL_STREAM_BUFFER_CREATE, &message, sizeof(message),
+                  NULL, 0);
+  return message.buffer_id;
+}
+
+void sl_stream_buffer_destroy(struct sl_context* ctx, uint32_t buffer_id) {
+  struct sl_stream_buffer_destroy message = {buffer_id};
+
+  sl_stream_write(ctx, SL_STREAM_BUFFER_DESTROY, &message, sizeof(message),
+                  NULL, 0);
+}
+
+void sl_stream_damage(struct sl_context* ctx,
+                      uint32_t buffer_id,
+                      uint8_t* dst_base,
+                      uint8_t* dst,
+                      size_t dst_stride,
+                      uint8_t* src,
+                      size_t src_stride,
+                      size_t row_bytes,
+                      size_t rows,
+                      int delta) {
+  struct sl_stream_damage message = {
+      .buffer_id = buffer_id,
+      .flags = delta ? SL_STREAM_DAMAGE_DELTA : 0,
+      .offset = dst - dst_base,
+      .stride = dst_stride,
+      .row_bytes = row_bytes,
+      .rows = rows};
+  uint8_t* scratch;
+  size_t y, x;
+
+  sl_stream_reserve(ctx, row_bytes * rows);
+  scratch = ctx->stream.scratch;
+
+  // Unchanged pixels become zero bytes when delta encoded, which PackBits
+  // collapses into short runs.
+  for (y = 0; y < rows; ++y) {
+    if (delta) {
+      for (x = 0; x < row_bytes; ++x)
+        scratch[x] = src[x] ^ dst[x];
+    } else {
+      memcpy(scratch, src, row_bytes);
+    }
+    scratch += row_bytes;
+    src += src_stride;
+    dst += dst_stride;
+  }
+
+  message.size =
+      sl_stream_pack(ctx->stream.packed, ctx->stream.scratch, row_bytes * rows);
+  sl_stream_write(ctx, SL_STREAM_DAMAGE, &message, sizeof(message),
+                  ctx->stream.packed, message.size);
+}
+
+void sl_stream_commit(struct sl_context* ctx,
+                      uint32_t surface_id,
+                      uint32_t buffer_id) {
+  struct sl_stream_commit message = {surface_id, buffer_id};
+
+  sl_stream_write(ctx, SL_STREAM_COMMIT, &message, sizeof(message), NULL, 0);
+}
+
+// Returns 1 while the receiver is too far behind for more commits to be
+// written. Buffers whose commits are dropped have to be sent in full once
+// the stream catches up, as the receiver no longer has their contents.
+int sl_stream_congested(struct sl_context* ctx) {
+  return ctx->stream.queue_size > STREAM_QUEUE_LIMIT;
+}
+
+// Calls the done function of |waiter| once everything queued so far has
+// been written, or the stream has been closed.
+void sl_stream_wait(struct sl_context* ctx, struct sl_stream_waiter* waiter) {
+  waiter->position = ctx->stream.written + ctx->stream.queue_size;
+  wl_list_insert(ctx->stream.waiters.prev, &waiter->link);
+  sl_stream_schedule_waiters(ctx);
+}
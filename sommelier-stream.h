@@ -0,0 +1,92 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_STREAM_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Messages written to the damage stream. Every message starts with a
+// header, and all fields use host byte order since the receiver runs on the
+// same machine.
+enum {
+  SL_STREAM_BUFFER_CREATE = 1,
+  SL_STREAM_BUFFER_DESTROY,
+  SL_STREAM_DAMAGE,
+  SL_STREAM_COMMIT,
+};
+
+// Damage data is XOR'ed against the previous contents of the buffer.
+#define SL_STREAM_DAMAGE_DELTA 0x1
+
+struct sl_stream_header {
+  uint32_t type;
+  uint32_t size;
+};
+
+struct sl_stream_buffer_create {
+  uint32_t buffer_id;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint32_t size;
+  uint32_t offset[2];
+  uint32_t stride[2];
+};
+
+struct sl_stream_buffer_destroy {
+  uint32_t buffer_id;
+};
+
+// Followed by |size| bytes of PackBits encoded data that expand to |rows|
+// rows of |row_bytes| bytes each, starting at |offset| in the buffer and
+// |stride| bytes apart.
+struct sl_stream_damage {
+  uint32_t buffer_id;
+  uint32_t flags;
+  uint32_t offset;
+  uint32_t stride;
+  uint32_t row_bytes;
+  uint32_t rows;
+  uint32_t size;
+};
+
+struct sl_stream_commit {
+  uint32_t surface_id;
+  uint32_t buffer_id;
+};
+
+// Buffer reconstructed by a receiver from the messages of a stream.
+struct sl_stream_received_buffer {
+  struct sl_stream_buffer_create info;
+  uint8_t* data;
+  struct sl_stream_received_buffer* next;
+};
+
+typedef void (*sl_stream_commit_func_t)(
+    void* data,
+    uint32_t surface_id,
+    struct sl_stream_received_buffer* buffer);
+
+struct sl_stream_receiver {
+  int fd;
+  uint8_t* input;
+  size_t input_size;
+  size_t input_capacity;
+  uint8_t* scratch;
+  size_t scratch_size;
+  struct sl_stream_received_buffer* buffers;
+  sl_stream_commit_func_t commit;
+  void* data;
+};
+
+void sl_stream_receiver_init(struct sl_stream_receiver* receiver,
+                             int fd,
+                             sl_stream_commit_func_t commit,
+                             void* data);
+int sl_stream_receiver_dispatch(struct sl_stream_receiver* receiver);
+void sl_stream_receiver_fini(struct sl_stream_receiver* receiver);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_STREAM_H_
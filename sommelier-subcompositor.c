@@ -18,6 +18,8 @@ struct sl_host_subsurface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_subsurface* proxy;
+  struct sl_host_surface* surface;
+  struct wl_listener surface_destroy_listener;
 };
 
 static void sl_subsurface_destroy(struct wl_client* client,
@@ -59,6 +61,12 @@ static void sl_subsurface_set_sync(struct wl_client* client,
                                    struct wl_resource* resource) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
 
+  // Cached state of the surface and its descendants takes effect with the
+  // parent again.
+  if (host->surface) {
+    host->surface->subsurface_sync = 1;
+    sl_host_surface_link_pending_copy(host->surface);
+  }
   wl_subsurface_set_sync(host->proxy);
 }
 
@@ -66,6 +74,13 @@ static void sl_subsurface_set_desync(struct wl_client* client,
                                      struct wl_resource* resource) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
 
+  // The host applies cached state as soon as the surface is no longer
+  // synchronized, so pending copies have to be done before the request is
+  // forwarded.
+  if (host->surface) {
+    host->surface->subsurface_sync = 0;
+    sl_host_surface_resolve_pending_copies(host->surface);
+  }
   wl_subsurface_set_desync(host->proxy);
 }
 
@@ -77,11 +92,28 @@ static const struct wl_subsurface_interface sl_subsurface_implementation = {
 static void sl_destroy_host_subsurface(struct wl_resource* resource) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
 
+  // The surface is unmapped, so cached state never takes effect.
+  if (host->surface) {
+    sl_host_surface_discard_pending_copy(host->surface);
+    host->surface->subsurface_parent = NULL;
+    host->surface->subsurface_sync = 0;
+  }
+  wl_list_remove(&host->surface_destroy_listener.link);
   wl_subsurface_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
 
+static void sl_subsurface_surface_destroyed(struct wl_listener* listener,
+                                           void* data) {
+  struct sl_host_subsurface* host =
+      wl_container_of(listener, host, surface_destroy_listener);
+
+  wl_list_remove(&host->surface_destroy_listener.link);
+  wl_list_init(&host->surface_destroy_listener.link);
+  host->surface = NULL;
+}
+
 static void sl_subcompositor_destroy(struct wl_client* client,
                                      struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -104,6 +136,11 @@ static void sl_subcompositor_get_subsurface(
   assert(host_subsurface);
 
   host_subsurface->ctx = host->ctx;
+  host_subsurface->surface = host_surface;
+  host_subsurface->surface_destroy_listener.notify =
+      sl_subsurface_surface_destroyed;
+  wl_resource_add_destroy_listener(surface_resource,
+                                   &host_subsurface->surface_destroy_listener);
   host_subsurface->resource =
       wl_resource_create(client, &wl_subsurface_interface, 1, id);
   wl_resource_set_implementation(host_subsurface->resource,
@@ -113,6 +150,10 @@ static void sl_subcompositor_get_subsurface(
       host->proxy, host_surface->proxy, host_parent->proxy);
   wl_subsurface_set_user_data(host_subsurface->proxy, host_subsurface);
   host_surface->has_role = 1;
+
+  // Subsurfaces start out synchronized.
+  host_surface->subsurface_parent = host_parent;
+  host_surface->subsurface_sync = 1;
 }
 
 static const struct wl_subcompositor_interface sl_subcompositor_implementation =
@@ -11,6 +11,10 @@
 #include "text-input-unstable-v1-client-protocol.h"
 #include "text-input-unstable-v1-server-protocol.h"
 
+// Surrounding text is limited to this many bytes on each side of the
+// cursor and anchor before it is forwarded to the host.
+#define SURROUNDING_TEXT_MARGIN 1024
+
 struct sl_host_text_input_manager {
   struct sl_context* ctx;
   struct wl_resource* resource;
@@ -21,8 +25,17 @@ struct sl_host_text_input {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zwp_text_input_v1* proxy;
+  char* surrounding_text;
+  uint32_t surrounding_cursor;
+  uint32_t surrounding_anchor;
 };
 
+static void sl_text_input_clear_surrounding_text(
+    struct sl_host_text_input* host) {
+  free(host->surrounding_text);
+  host->surrounding_text = NULL;
+}
+
 static void sl_text_input_activate(struct wl_client* client,
                                    struct wl_resource* resource,
                                    struct wl_resource* seat,
@@ -31,6 +44,7 @@ static void sl_text_input_activate(struct wl_client* client,
   struct sl_host_seat* host_seat = wl_resource_get_user_data(seat);
   struct sl_host_surface* host_surface = wl_resource_get_user_data(surface);
 
+  sl_text_input_clear_surrounding_text(host);
   zwp_text_input_v1_activate(host->proxy, host_seat->proxy,
                              host_surface->proxy);
 }
@@ -41,6 +55,7 @@ static void sl_text_input_deactivate(struct wl_client* client,
   struct sl_host_text_input* host = wl_resource_get_user_data(resource);
   struct sl_host_seat* host_seat = wl_resource_get_user_data(seat);
 
+  sl_text_input_clear_surrounding_text(host);
   zwp_text_input_v1_deactivate(host->proxy, host_seat->proxy);
 }
 
@@ -62,6 +77,7 @@ static void sl_text_input_reset(struct wl_client* client,
                                 struct wl_resource* resource) {
   struct sl_host_text_input* host = wl_resource_get_user_data(resource);
 
+  sl_text_input_clear_surrounding_text(host);
   zwp_text_input_v1_reset(host->proxy);
 }
 
@@ -71,8 +87,56 @@ static void sl_text_input_set_surrounding_text(struct wl_client* client,
                                                uint32_t cursor,
                                                uint32_t anchor) {
   struct sl_host_text_input* host = wl_resource_get_user_data(resource);
-
-  zwp_text_input_v1_set_surrounding_text(host->proxy, text, cursor, anchor);
+  size_t length = strlen(text);
+  size_t start, end;
+  char* window;
+
+  cursor = MIN(cursor, length);
+  anchor = MIN(anchor, length);
+
+  // A selection larger than the margin is truncated by moving the anchor
+  // towards the cursor, without splitting a UTF-8 sequence.
+  if (anchor > cursor + SURROUNDING_TEXT_MARGIN) {
+    anchor = cursor + SURROUNDING_TEXT_MARGIN;
+    while ((text[anchor] & 0xc0) == 0x80)
+      --anchor;
+  } else if (cursor > anchor + SURROUNDING_TEXT_MARGIN) {
+    anchor = cursor - SURROUNDING_TEXT_MARGIN;
+    while ((text[anchor] & 0xc0) == 0x80)
+      ++anchor;
+  }
+
+  // Only forward text within the margin of the cursor and anchor.
+  start = MIN(cursor, anchor);
+  start = start > SURROUNDING_TEXT_MARGIN ? start - SURROUNDING_TEXT_MARGIN : 0;
+  end = MIN(length, (size_t)MAX(cursor, anchor) + SURROUNDING_TEXT_MARGIN);
+  while (start > 0 && (text[start] & 0xc0) == 0x80)
+    --start;
+  while (end < length && (text[end] & 0xc0) == 0x80)
+    ++end;
+
+  window = strndup(text + start, end - start);
+  assert(window);
+  cursor -= start;
+  anchor -= start;
+
+  // Clients often send the same state again, for example with every
+  // commit_state, and the host has nothing new to learn from it.
+  if (host->surrounding_text && host->surrounding_cursor == cursor &&
+      host->surrounding_anchor == anchor &&
+      !strcmp(host->surrounding_text, window)) {
+    free(window);
+    return;
+  }
+
+  // Offsets in events from the host, such as delete_surrounding_text and
+  // cursor_position, are relative to the cursor so they apply to the full
+  // text unchanged.
+  zwp_text_input_v1_set_surrounding_text(host->proxy, window, cursor, anchor);
+  free(host->surrounding_text);
+  host->surrounding_text = window;
+  host->surrounding_cursor = cursor;
+  host->surrounding_anchor = anchor;
 }
 
 static void sl_text_input_set_content_type(struct wl_client* client,
@@ -266,6 +330,7 @@ static void sl_destroy_host_text_input(struct wl_resource* resource) {
   struct sl_host_text_input* host = wl_resource_get_user_data(resource);
 
   zwp_text_input_v1_destroy(host->proxy);
+  sl_text_input_clear_surrounding_text(host);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -280,6 +345,7 @@ static void sl_text_input_manager_create_text_input(
 
   text_input_host->resource = text_input_resource;
   text_input_host->ctx = host->ctx;
+  text_input_host->surrounding_text = NULL;
   text_input_host->proxy = zwp_text_input_manager_v1_create_text_input(
       host->ctx->text_input_manager->internal);
   wl_resource_set_implementation(text_input_resource,
@@ -21,6 +21,9 @@ struct sl_host_viewport {
   struct sl_viewport viewport;
 };
 
+static struct sl_slab sl_host_viewport_slab =
+    SL_SLAB_INIT(struct sl_host_viewport);
+
 static void sl_viewport_destroy(struct wl_client* client,
                                 struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -58,7 +61,7 @@ static void sl_destroy_host_viewport(struct wl_resource* resource) {
 
   wl_resource_set_user_data(resource, NULL);
   wl_list_remove(&host->viewport.link);
-  free(host);
+  sl_slab_free(&sl_host_viewport_slab, host);
 }
 
 static void sl_viewporter_destroy(struct wl_client* client,
@@ -74,8 +77,7 @@ static void sl_viewporter_get_viewport(struct wl_client* client,
       wl_resource_get_user_data(surface_resource);
   struct sl_host_viewport* host_viewport;
 
-  host_viewport = malloc(sizeof(*host_viewport));
-  assert(host_viewport);
+  host_viewport = sl_slab_alloc(&sl_host_viewport_slab);
 
   host_viewport->viewport.src_x = -1;
   host_viewport->viewport.src_y = -1;
@@ -20,12 +20,14 @@ struct sl_host_xdg_surface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zxdg_surface_v6* proxy;
+  struct sl_host_surface* host_surface;
 };
 
 struct sl_host_xdg_toplevel {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zxdg_toplevel_v6* proxy;
+  struct sl_host_surface* host_surface;
 };
 
 struct sl_host_xdg_popup {
@@ -210,6 +212,9 @@ static void sl_xdg_toplevel_set_app_id(struct wl_client* client,
                                        const char* app_id) {
   struct sl_host_xdg_toplevel* host = wl_resource_get_user_data(resource);
 
+  // Wayland clients are matched against profiles by their app ID, as X11
+  // windows are by WM_CLASS.
+  sl_profile_apply(sl_profile_find(host->ctx, app_id), host->host_surface);
   zxdg_toplevel_v6_set_app_id(host->proxy, app_id);
 }
 
@@ -366,6 +371,7 @@ static void sl_xdg_surface_get_toplevel(struct wl_client* client,
   assert(host_xdg_toplevel);
 
   host_xdg_toplevel->ctx = host->ctx;
+  host_xdg_toplevel->host_surface = host->host_surface;
   host_xdg_toplevel->resource =
       wl_resource_create(client, &zxdg_toplevel_v6_interface, 1, id);
   wl_resource_set_implementation(
@@ -493,6 +499,7 @@ static void sl_xdg_shell_get_xdg_surface(struct wl_client* client,
   assert(host_xdg_surface);
 
   host_xdg_surface->ctx = host->ctx;
+  host_xdg_surface->host_surface = host_surface;
   host_xdg_surface->resource =
       wl_resource_create(client, &zxdg_surface_v6_interface, 1, id);
   wl_resource_set_implementation(host_xdg_surface->resource,
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <gbm.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <linux/virtwl.h>
 #include <math.h>
@@ -20,18 +21,22 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <xcb/composite.h>
+#include <xcb/sync.h>
 #include <xcb/xfixes.h>
 #include <xcb/xproto.h>
+#include <xf86drm.h>
 
 #include "aura-shell-client-protocol.h"
 #include "drm-server-protocol.h"
 #include "keyboard-extension-unstable-v1-client-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "pointer-constraints-unstable-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "relative-pointer-unstable-v1-client-protocol.h"
 #include "text-input-unstable-v1-client-protocol.h"
 #include "viewporter-client-protocol.h"
@@ -78,6 +83,8 @@ enum {
   PROPERTY_NET_STARTUP_ID,
   PROPERTY_NET_WM_STATE,
   PROPERTY_GTK_THEME_VARIANT,
+  PROPERTY_WM_PROTOCOLS,
+  PROPERTY_NET_WM_SYNC_REQUEST_COUNTER,
 };
 
 #define US_POSITION (1L << 0)
@@ -195,6 +202,47 @@ struct sl_mwm_hints {
 #define MIN_AURA_SHELL_VERSION 6
 #define MAX_AURA_SHELL_VERSION 9
 
+// Increment of 240 is suggested by EWMH. One second at 60fps with an
+// increment of 4 per frame for extended counters.
+#define SYNC_REQUEST_INCREMENT 240
+#define SYNC_REQUEST_TIMEOUT_MS 1000
+
+#define IDLE_TRIM_TIMEOUT 10
+
+#define HOST_PROBE_INTERVAL_MS 1000
+
+// Pending X events are drained in batches of at most this many, which bounds
+// the cost of looking for events that supersede each other.
+#define X_EVENT_BATCH_SIZE 256
+
+// Relative to $XDG_CONFIG_HOME.
+#define PROFILES_PATH "sommelier/profiles"
+
+#define DMA_HEAP_PATH "/dev/dma_heap/system"
+// Rows of dmabufs allocated from a DMA heap are aligned to satisfy the
+// import requirements of common GPUs.
+#define DMA_HEAP_STRIDE_ALIGNMENT 256
+
+#define DMA_HEAP_IOC_MAGIC 'H'
+#define DMA_HEAP_IOCTL_ALLOC \
+  _IOWR(DMA_HEAP_IOC_MAGIC, 0x0, struct dma_heap_allocation_data)
+
+struct dma_heap_allocation_data {
+  __u64 len;
+  __u32 fd;
+  __u32 fd_flags;
+  __u64 heap_flags;
+};
+
+#define SLAB_ALIGNMENT 16
+#define SLAB_CHUNK_SIZE 16384
+
+#define SHM_DRIVER_CACHE_NAME "sommelier-shm-driver"
+#define SHM_DRIVER_CALIBRATION_WIDTH 1024
+#define SHM_DRIVER_CALIBRATION_HEIGHT 1024
+#define SHM_DRIVER_CALIBRATION_ITERATIONS 8
+#define SHM_DRIVER_CALIBRATION_TIMEOUT_US 1000000
+
 // Performs an asprintf operation and checks the result for validity and calls
 // abort() if there's a failure. Returns a newly allocated string rather than
 // taking a double pointer argument like asprintf.
@@ -210,16 +258,38 @@ __attribute__((__format__(__printf__, 1, 0))) static char* sl_xasprintf(
   return str;
 }
 
-struct sl_mmap* sl_mmap_create(int fd,
-                               size_t size,
-                               size_t bpp,
-                               size_t num_planes,
-                               size_t offset0,
-                               size_t stride0,
-                               size_t offset1,
-                               size_t stride1,
-                               size_t y_ss0,
-                               size_t y_ss1) {
+// Allocates a linear single plane dmabuf from the DMA heap. Returns the fd
+// of the dmabuf and sets |stride|, or returns -1 if allocation failed.
+int sl_dma_heap_alloc(struct sl_context* ctx,
+                      size_t width,
+                      size_t height,
+                      size_t bpp,
+                      size_t* stride) {
+  struct dma_heap_allocation_data data = {
+      .fd = 0, .fd_flags = O_RDWR | O_CLOEXEC, .heap_flags = 0};
+
+  *stride = (width * bpp + DMA_HEAP_STRIDE_ALIGNMENT - 1) &
+            ~(DMA_HEAP_STRIDE_ALIGNMENT - 1);
+  data.len = *stride * height;
+  if (ioctl(ctx->dma_heap_fd, DMA_HEAP_IOCTL_ALLOC, &data))
+    return -1;
+
+  return data.fd;
+}
+
+// Maps |size| + |offset0| bytes of |fd| starting at |map_offset|, which
+// must be page aligned. Plane offsets are relative to |map_offset|.
+struct sl_mmap* sl_mmap_create_at(int fd,
+                                  size_t map_offset,
+                                  size_t size,
+                                  size_t bpp,
+                                  size_t num_planes,
+                                  size_t offset0,
+                                  size_t stride0,
+                                  size_t offset1,
+                                  size_t stride1,
+                                  size_t y_ss0,
+                                  size_t y_ss1) {
   struct sl_mmap* map;
 
   map = malloc(sizeof(*map));
@@ -237,26 +307,153 @@ struct sl_mmap* sl_mmap_create(int fd,
   map->begin_write = NULL;
   map->end_write = NULL;
   map->buffer_resource = NULL;
-  map->addr =
-      mmap(NULL, size + offset0, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  map->addr = mmap(NULL, size + offset0, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, map_offset);
   assert(map->addr != MAP_FAILED);
 
   return map;
 }
 
+struct sl_mmap* sl_mmap_create(int fd,
+                               size_t size,
+                               size_t bpp,
+                               size_t num_planes,
+                               size_t offset0,
+                               size_t stride0,
+                               size_t offset1,
+                               size_t stride1,
+                               size_t y_ss0,
+                               size_t y_ss1) {
+  return sl_mmap_create_at(fd, 0, size, bpp, num_planes, offset0, stride0,
+                           offset1, stride1, y_ss0, y_ss1);
+}
+
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
   map->refcount++;
   return map;
 }
 
+// Returns the number of bytes of address space used by |map|.
+size_t sl_mmap_length(struct sl_mmap* map) {
+  return map->size + map->offset[0];
+}
+
 void sl_mmap_unref(struct sl_mmap* map) {
   if (map->refcount-- == 1) {
-    munmap(map->addr, map->size + map->offset[0]);
+    munmap(map->addr, sl_mmap_length(map));
     close(map->fd);
     free(map);
   }
 }
 
+// Chunks are aligned to their size so that the chunk an object belongs to
+// can be found from its address.
+struct sl_slab_chunk {
+  struct sl_slab_chunk* next;
+  size_t used;
+};
+
+#define SLAB_CHUNK_HEADER_SIZE                           \
+  ((sizeof(struct sl_slab_chunk) + SLAB_ALIGNMENT - 1) & \
+   ~(SLAB_ALIGNMENT - 1))
+
+// Slabs that have allocated at least one chunk, so that empty chunks can be
+// returned by sl_slab_trim().
+static struct sl_slab* sl_slabs = NULL;
+
+struct sl_slab sl_host_callback_slab = SL_SLAB_INIT(struct sl_host_callback);
+
+static struct sl_slab_chunk* sl_slab_chunk_for(void* object) {
+  return (struct sl_slab_chunk*)((uintptr_t)object &
+                                 ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+}
+
+static void sl_slab_push(struct sl_slab* slab, void* object) {
+  *(void**)object = slab->free_list;
+  slab->free_list = object;
+}
+
+void* sl_slab_alloc(struct sl_slab* slab) {
+  void* object;
+
+  if (!slab->free_list) {
+    // Round up so that every object in a chunk is suitably aligned and
+    // large enough to hold the free list link.
+    size_t size = MAX(slab->object_size, sizeof(void*));
+    struct sl_slab_chunk* chunk;
+    size_t count, i;
+    void* memory;
+    int rv;
+
+    size = (size + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1);
+    assert(size <= SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER_SIZE);
+    count = (SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER_SIZE) / size;
+    rv = posix_memalign(&memory, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+    assert(!rv);
+    UNUSED(rv);
+
+    chunk = memory;
+    chunk->used = 0;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    if (!slab->registered) {
+      slab->next = sl_slabs;
+      sl_slabs = slab;
+      slab->registered = 1;
+    }
+
+    // Push in reverse so that objects are handed out in address order.
+    for (i = count; i > 0; --i) {
+      sl_slab_push(slab,
+                   (uint8_t*)chunk + SLAB_CHUNK_HEADER_SIZE + (i - 1) * size);
+    }
+  }
+
+  object = slab->free_list;
+  slab->free_list = *(void**)object;
+  sl_slab_chunk_for(object)->used++;
+  return object;
+}
+
+void sl_slab_free(struct sl_slab* slab, void* object) {
+  sl_slab_chunk_for(object)->used--;
+  sl_slab_push(slab, object);
+}
+
+// Returns chunks without live objects to the system and reports how many
+// bytes were released. Objects of empty chunks are dropped from the free
+// lists first, which is linear in the number of free objects.
+size_t sl_slab_trim(void) {
+  size_t bytes = 0;
+  struct sl_slab* slab;
+
+  for (slab = sl_slabs; slab; slab = slab->next) {
+    struct sl_slab_chunk** chunk = &slab->chunks;
+    void** object = &slab->free_list;
+
+    while (*object) {
+      if (sl_slab_chunk_for(*object)->used)
+        object = (void**)*object;
+      else
+        *object = *(void**)*object;
+    }
+
+    while (*chunk) {
+      struct sl_slab_chunk* next = (*chunk)->next;
+
+      if ((*chunk)->used) {
+        chunk = &(*chunk)->next;
+      } else {
+        free(*chunk);
+        *chunk = next;
+        bytes += SLAB_CHUNK_SIZE;
+      }
+    }
+  }
+
+  return bytes;
+}
+
 struct sl_sync_point* sl_sync_point_create(int fd) {
   struct sl_sync_point* sync_point;
 
@@ -318,6 +515,137 @@ static void sl_adjust_window_position_for_screen_size(
   window->y = ctx->screen->height_in_pixels / 2 - window->height / 2;
 }
 
+static void sl_window_sync_done(struct sl_window* window) {
+  struct wl_resource* host_resource;
+  struct sl_host_surface* host_surface = NULL;
+
+  window->sync_pending = 0;
+  wl_event_source_timer_update(window->sync_timeout_event_source, 0);
+
+  host_resource =
+      wl_client_get_object(window->ctx->client, window->host_surface_id);
+  if (host_resource)
+    host_surface = wl_resource_get_user_data(host_resource);
+
+  // Contents for the configure may already have been committed.
+  if (sl_process_pending_configure_acks(window, host_surface)) {
+    if (host_surface)
+      sl_host_surface_forward_commit(host_surface);
+  }
+}
+
+static int sl_handle_sync_timeout(void* data) {
+  struct sl_window* window = (struct sl_window*)data;
+
+  // Stop waiting for clients that fail to update the counter in time, and
+  // for contents of a drawn configure that were never attached.
+  if (window->sync_pending || window->sync_drawn)
+    sl_window_sync_done(window);
+  return 0;
+}
+
+static void sl_window_send_sync_request(struct sl_window* window) {
+  struct sl_context* ctx = window->ctx;
+  xcb_client_message_event_t event = {
+      .response_type = XCB_CLIENT_MESSAGE,
+      .format = 32,
+      .window = window->id,
+      .type = ctx->atoms[ATOM_WM_PROTOCOLS].value,
+  };
+  uint32_t values[2];
+
+  // The client has drawn contents for the configure once the counter
+  // reaches this value.
+  window->sync_value =
+      MAX(window->sync_value, window->sync_counter_value) +
+      SYNC_REQUEST_INCREMENT;
+  values[0] = window->sync_value >> 32;
+  values[1] = window->sync_value & 0xffffffff;
+
+  event.data.data32[0] = ctx->atoms[ATOM_NET_WM_SYNC_REQUEST].value;
+  event.data.data32[1] = XCB_CURRENT_TIME;
+  event.data.data32[2] = values[1];
+  event.data.data32[3] = values[0];
+  event.data.data32[4] = window->sync_extended;
+  xcb_send_event(ctx->connection, 0, window->id, XCB_EVENT_MASK_NO_EVENT,
+                 (const char*)&event);
+
+  if (!window->sync_timeout_event_source) {
+    window->sync_timeout_event_source =
+        wl_event_loop_add_timer(wl_display_get_event_loop(ctx->host_display),
+                                sl_handle_sync_timeout, window);
+  }
+  wl_event_source_timer_update(window->sync_timeout_event_source,
+                               SYNC_REQUEST_TIMEOUT_MS);
+  window->sync_pending = 1;
+  window->sync_drawn = 0;
+}
+
+static void sl_window_send_frame_drawn(struct sl_window* window) {
+  struct sl_context* ctx = window->ctx;
+  int64_t value = window->sync_counter_value;
+  xcb_client_message_event_t event = {
+      .response_type = XCB_CLIENT_MESSAGE,
+      .format = 32,
+      .window = window->id,
+      .type = ctx->atoms[ATOM_NET_WM_FRAME_DRAWN].value,
+  };
+  uint64_t now_us = sl_now_us();
+
+  // The counter value is tracked from alarm events. An odd value means that
+  // the client is still drawing a frame, so the message is sent once the
+  // counter is even again.
+  if (value & 1) {
+    window->frame_drawn_pending = 1;
+    return;
+  }
+  window->frame_drawn_pending = 0;
+
+  event.data.data32[0] = value & 0xffffffff;
+  event.data.data32[1] = value >> 32;
+  event.data.data32[2] = window->frame_commit_us & 0xffffffff;
+  event.data.data32[3] = window->frame_commit_us >> 32;
+  xcb_send_event(ctx->connection, 0, window->id, XCB_EVENT_MASK_NO_EVENT,
+                 (const char*)&event);
+
+  // The host doesn't report refresh interval or frame delay, so only the
+  // presentation offset relative to the frame drawn time is provided.
+  event.type = ctx->atoms[ATOM_NET_WM_FRAME_TIMINGS].value;
+  event.data.data32[2] = now_us - window->frame_commit_us;
+  event.data.data32[3] = 0;
+  event.data.data32[4] = 0;
+  xcb_send_event(ctx->connection, 0, window->id, XCB_EVENT_MASK_NO_EVENT,
+                 (const char*)&event);
+}
+
+static void sl_window_cancel_frame(struct sl_window* window) {
+  window->frame_pending = 0;
+}
+
+void sl_window_request_frame(struct sl_window* window) {
+  // Frame drawn messages are only sent to clients using extended counters.
+  // One frame is reported at a time, which paces the client to the host.
+  if (!window->sync_extended || window->frame_pending)
+    return;
+  if (window->profile && !window->profile->frame_sync)
+    return;
+
+  window->frame_pending = 1;
+  window->frame_commit_us = sl_now_us();
+}
+
+// Reports the requested frame as drawn. This happens when the host frame
+// callback for the commit arrives, or as soon as the commit is forwarded
+// when the surface coalesces commits. In that case the host frame callback
+// still paces the forwarding of later commits, and with it the client.
+void sl_window_frame_done(struct sl_window* window) {
+  if (!window->frame_pending)
+    return;
+
+  window->frame_pending = 0;
+  sl_window_send_frame_drawn(window);
+}
+
 static void sl_configure_window(struct sl_window* window) {
   assert(!window->pending_config.serial);
 
@@ -325,6 +653,8 @@ static void sl_configure_window(struct sl_window* window) {
     int values[5];
     int x = window->x;
     int y = window->y;
+    int width = window->width;
+    int height = window->height;
     int i = 0;
 
     xcb_configure_window(window->ctx->connection, window->frame_id,
@@ -341,6 +671,13 @@ static void sl_configure_window(struct sl_window* window) {
     if (window->next_config.mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
       window->border_width = window->next_config.values[i++];
 
+    // The sync request must arrive before the configure notify.
+    if (window->sync_counter &&
+        (!window->profile || window->profile->frame_sync) &&
+        (window->width != width || window->height != height)) {
+      sl_window_send_sync_request(window);
+    }
+
     // Set x/y to origin in case window gravity is not northwest as expected.
     assert(window->managed);
     values[0] = 0;
@@ -433,13 +770,19 @@ int sl_process_pending_configure_acks(struct sl_window* window,
   if (window->managed && host_surface) {
     int width = window->width + window->border_width * 2;
     int height = window->height + window->border_width * 2;
+
+    // Wait for the client to finish drawing if it supports sync requests.
+    if (window->sync_pending)
+      return 0;
     // Early out if we expect contents to match window size at some point in
-    // the future.
-    if (width != host_surface->contents_width ||
-        height != host_surface->contents_height) {
+    // the future. Not needed when the client reported that the contents
+    // being attached were drawn for the configure.
+    if (!window->sync_drawn && (width != host_surface->contents_width ||
+                                height != host_surface->contents_height)) {
       return 0;
     }
   }
+  window->sync_drawn = 0;
 
   if (window->xdg_surface) {
     zxdg_surface_v6_ack_configure(window->xdg_surface,
@@ -471,7 +814,7 @@ static void sl_internal_xdg_surface_configure(
 
     if (sl_process_pending_configure_acks(window, host_surface)) {
       if (host_surface)
-        wl_surface_commit(host_surface->proxy);
+        sl_host_surface_forward_commit(host_surface);
     }
   }
 }
@@ -656,6 +999,7 @@ void sl_window_update(struct sl_window* window) {
       zxdg_surface_v6_destroy(window->xdg_surface);
       window->xdg_surface = NULL;
     }
+    sl_window_cancel_frame(window);
     window->realized = 0;
     return;
   }
@@ -664,6 +1008,9 @@ void sl_window_update(struct sl_window* window) {
   assert(host_surface);
   assert(!host_surface->has_role);
 
+  window->profile = sl_profile_find(ctx, window->clazz);
+  sl_profile_apply(window->profile, host_surface);
+
   assert(ctx->xdg_shell);
   assert(ctx->xdg_shell->internal);
 
@@ -814,9 +1161,11 @@ void sl_window_update(struct sl_window* window) {
                              (window->y - parent->y) / ctx->scale);
   }
 
-  wl_surface_commit(host_surface->proxy);
-  if (host_surface->contents_width && host_surface->contents_height)
+  sl_host_surface_forward_commit(host_surface);
+  if (host_surface->contents_width && host_surface->contents_height) {
+    sl_stats_window_realized(window);
     window->realized = 1;
+  }
 }
 
 static void sl_host_buffer_destroy(struct wl_client* client,
@@ -1212,6 +1561,17 @@ static void sl_registry_handler(void* data,
     viewporter->host_viewporter_global = sl_viewporter_global_create(ctx);
     // Allow non-integer scale.
     ctx->scale = MIN(MAX_SCALE, MAX(MIN_SCALE, ctx->desired_scale));
+  } else if (strcmp(interface, "wp_presentation") == 0) {
+    struct sl_presentation* presentation =
+        malloc(sizeof(struct sl_presentation));
+    assert(presentation);
+    presentation->ctx = ctx;
+    presentation->id = id;
+    presentation->internal =
+        wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+    assert(!ctx->presentation);
+    ctx->presentation = presentation;
+    presentation->host_global = sl_presentation_global_create(ctx);
   } else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
     struct sl_linux_dmabuf* linux_dmabuf =
         malloc(sizeof(struct sl_linux_dmabuf));
@@ -1315,6 +1675,13 @@ static void sl_registry_remover(void* data,
     ctx->viewporter = NULL;
     return;
   }
+  if (ctx->presentation && ctx->presentation->id == id) {
+    sl_global_destroy(ctx->presentation->host_global);
+    wp_presentation_destroy(ctx->presentation->internal);
+    free(ctx->presentation);
+    ctx->presentation = NULL;
+    return;
+  }
   if (ctx->linux_dmabuf && ctx->linux_dmabuf->id == id) {
     if (ctx->linux_dmabuf->host_drm_global)
       sl_global_destroy(ctx->linux_dmabuf->host_drm_global);
@@ -1442,6 +1809,20 @@ static void sl_create_window(struct sl_context* ctx,
   window->pending_config.serial = 0;
   window->pending_config.mask = 0;
   window->pending_config.states_length = 0;
+  window->sync_counter = 0;
+  window->sync_alarm = 0;
+  window->sync_extended = 0;
+  window->sync_value = 0;
+  window->sync_counter_value = 0;
+  window->sync_pending = 0;
+  window->sync_drawn = 0;
+  window->sync_timeout_event_source = NULL;
+  window->frame_pending = 0;
+  window->frame_drawn_pending = 0;
+  window->frame_commit_us = 0;
+  window->sync_request = 0;
+  window->profile = NULL;
+  window->map_us = 0;
   wl_list_insert(&ctx->unpaired_windows, &window->link);
   values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE;
   xcb_change_window_attributes(ctx->connection, window->id, XCB_CW_EVENT_MASK,
@@ -1466,6 +1847,12 @@ static void sl_destroy_window(struct sl_window* window) {
   if (window->aura_surface)
     zaura_surface_destroy(window->aura_surface);
 
+  sl_window_cancel_frame(window);
+  if (window->sync_timeout_event_source)
+    wl_event_source_remove(window->sync_timeout_event_source);
+  if (window->sync_alarm)
+    xcb_sync_destroy_alarm(window->ctx->connection, window->sync_alarm);
+
   if (window->name)
     free(window->name);
   if (window->clazz)
@@ -1587,6 +1974,71 @@ static void sl_decode_wm_class(struct sl_window* window,
   }
 }
 
+// Returns the counter from a _NET_WM_SYNC_REQUEST_COUNTER property. The
+// second counter, if present, is the extended counter.
+static xcb_sync_counter_t sl_window_read_sync_counter(
+    struct sl_window* window, xcb_get_property_reply_t* reply) {
+  window->sync_extended = xcb_get_property_value_length(reply) >= 8;
+  if (xcb_get_property_value_length(reply) < 4)
+    return 0;
+
+  return ((uint32_t*)xcb_get_property_value(
+      reply))[window->sync_extended ? 1 : 0];
+}
+
+static void sl_window_setup_sync(struct sl_window* window,
+                                 xcb_sync_counter_t counter) {
+  struct sl_context* ctx = window->ctx;
+  xcb_sync_query_counter_reply_t* reply;
+  uint32_t values[8];
+
+  window->sync_pending = 0;
+  window->sync_drawn = 0;
+  window->sync_counter = 0;
+  window->frame_drawn_pending = 0;
+  if (!counter || !ctx->sync_extension->present) {
+    window->sync_extended = 0;
+    return;
+  }
+
+  reply = xcb_sync_query_counter_reply(
+      ctx->connection, xcb_sync_query_counter(ctx->connection, counter), NULL);
+  if (!reply) {
+    window->sync_extended = 0;
+    return;
+  }
+  window->sync_value = ((int64_t)reply->counter_value.hi << 32) |
+                       reply->counter_value.lo;
+  window->sync_counter_value = window->sync_value;
+  free(reply);
+
+  // The alarm triggers on every increment of the counter, which is how its
+  // value is tracked without a round trip for each frame.
+  values[0] = counter;
+  values[1] = XCB_SYNC_VALUETYPE_ABSOLUTE;
+  values[2] = (window->sync_value + 1) >> 32;
+  values[3] = (window->sync_value + 1) & 0xffffffff;
+  values[4] = XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON;
+  values[5] = 0;
+  values[6] = 1;
+  values[7] = 1;
+  if (!window->sync_alarm) {
+    window->sync_alarm = xcb_generate_id(ctx->connection);
+    xcb_sync_create_alarm(ctx->connection, window->sync_alarm,
+                          XCB_SYNC_CA_COUNTER | XCB_SYNC_CA_VALUE_TYPE |
+                              XCB_SYNC_CA_VALUE | XCB_SYNC_CA_TEST_TYPE |
+                              XCB_SYNC_CA_DELTA | XCB_SYNC_CA_EVENTS,
+                          values);
+  } else {
+    xcb_sync_change_alarm(ctx->connection, window->sync_alarm,
+                          XCB_SYNC_CA_COUNTER | XCB_SYNC_CA_VALUE_TYPE |
+                              XCB_SYNC_CA_VALUE | XCB_SYNC_CA_TEST_TYPE |
+                              XCB_SYNC_CA_DELTA | XCB_SYNC_CA_EVENTS,
+                          values);
+  }
+  window->sync_counter = counter;
+}
+
 static void sl_handle_map_request(struct sl_context* ctx,
                                   xcb_map_request_event_t* event) {
   struct sl_window* window = sl_lookup_window(ctx, event->window);
@@ -1603,6 +2055,9 @@ static void sl_handle_map_request(struct sl_context* ctx,
       {PROPERTY_NET_STARTUP_ID, ctx->atoms[ATOM_NET_STARTUP_ID].value},
       {PROPERTY_NET_WM_STATE, ctx->atoms[ATOM_NET_WM_STATE].value},
       {PROPERTY_GTK_THEME_VARIANT, ctx->atoms[ATOM_GTK_THEME_VARIANT].value},
+      {PROPERTY_WM_PROTOCOLS, ctx->atoms[ATOM_WM_PROTOCOLS].value},
+      {PROPERTY_NET_WM_SYNC_REQUEST_COUNTER,
+       ctx->atoms[ATOM_NET_WM_SYNC_REQUEST_COUNTER].value},
   };
   xcb_get_geometry_cookie_t geometry_cookie;
   xcb_get_property_cookie_t property_cookies[ARRAY_SIZE(properties)];
@@ -1610,14 +2065,19 @@ static void sl_handle_map_request(struct sl_context* ctx,
   struct sl_mwm_hints mwm_hints = {0};
   xcb_atom_t* reply_atoms;
   bool maximize_h = false, maximize_v = false;
+  bool sync_request = false;
+  uint32_t sync_counter = 0;
   uint32_t values[5];
-  int i;
+  int i, j;
 
   if (!window)
     return;
 
   assert(!sl_is_our_window(ctx, event->window));
 
+  if (ctx->stats.interval)
+    window->map_us = sl_now_us();
+
   window->managed = 1;
   if (window->frame_id == XCB_WINDOW_NONE)
     geometry_cookie = xcb_get_geometry(ctx->connection, window->id);
@@ -1696,13 +2156,13 @@ static void sl_handle_map_request(struct sl_context* ctx,
         break;
       case PROPERTY_NET_WM_STATE:
         reply_atoms = xcb_get_property_value(reply);
-        for (i = 0;
-             i < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
-             ++i) {
-          if (reply_atoms[i] ==
+        for (j = 0;
+             j < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+             ++j) {
+          if (reply_atoms[j] ==
               ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_HORZ].value) {
             maximize_h = true;
-          } else if (reply_atoms[i] ==
+          } else if (reply_atoms[j] ==
                      ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_VERT].value) {
             maximize_v = true;
           }
@@ -1716,6 +2176,18 @@ static void sl_handle_map_request(struct sl_context* ctx,
         if (xcb_get_property_value_length(reply) >= 4)
           window->dark_frame = !strcmp(xcb_get_property_value(reply), "dark");
         break;
+      case PROPERTY_WM_PROTOCOLS:
+        reply_atoms = xcb_get_property_value(reply);
+        for (j = 0;
+             j < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+             ++j) {
+          if (reply_atoms[j] == ctx->atoms[ATOM_NET_WM_SYNC_REQUEST].value)
+            sync_request = true;
+        }
+        break;
+      case PROPERTY_NET_WM_SYNC_REQUEST_COUNTER:
+        sync_counter = sl_window_read_sync_counter(window, reply);
+        break;
       default:
         break;
     }
@@ -1750,6 +2222,9 @@ static void sl_handle_map_request(struct sl_context* ctx,
     }
   }
 
+  window->sync_request = sync_request;
+  sl_window_setup_sync(window, sync_request ? sync_counter : 0);
+
   window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
   if (window->size_flags & P_MIN_SIZE) {
     window->min_width = size_hints.min_width;
@@ -1827,7 +2302,17 @@ static void sl_handle_map_request(struct sl_context* ctx,
 }
 
 static void sl_handle_map_notify(struct sl_context* ctx,
-                                 xcb_map_notify_event_t* event) {}
+                                 xcb_map_notify_event_t* event) {
+  struct sl_window* window;
+
+  // Managed windows are timed from the map request instead.
+  if (!ctx->stats.interval || !event->override_redirect)
+    return;
+
+  window = sl_lookup_window(ctx, event->window);
+  if (window)
+    window->map_us = sl_now_us();
+}
 
 static void sl_handle_unmap_notify(struct sl_context* ctx,
                                    xcb_unmap_notify_event_t* event) {
@@ -1849,6 +2334,13 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
   }
 
   if (window->host_surface_id) {
+    struct wl_resource* host_resource =
+        wl_client_get_object(ctx->client, window->host_surface_id);
+
+    // Intermediate buffers are not needed while the window is unmapped.
+    if (host_resource)
+      sl_host_surface_release_buffers(wl_resource_get_user_data(host_resource));
+
     window->host_surface_id = 0;
     sl_window_update(window);
   }
@@ -2186,6 +2678,7 @@ int sl_begin_data_source_send(struct sl_context* ctx,
   UNUSED(rv);
 
   ctx->selection_data_source_send_fd = fd;
+  sl_transfer_begin(ctx, &ctx->stats.x11_to_wayland_transfer);
   free(reply);
   return 1;
 }
@@ -2215,6 +2708,7 @@ static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
                ctx->selection_property_offset;
 
   bytes = write(fd, value + ctx->selection_property_offset, bytes_left);
+  sl_transfer_progress(&ctx->stats.x11_to_wayland_transfer, bytes);
   if (bytes == -1) {
     fprintf(stderr, "write error to target fd: %m\n");
     close(fd);
@@ -2240,6 +2734,8 @@ static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
   }
   if (fd < 0) {
     ctx->selection_data_source_send_fd = -1;
+    sl_transfer_end(ctx, &ctx->stats.x11_to_wayland,
+                    &ctx->stats.x11_to_wayland_transfer);
     sl_process_data_source_send_pending_list(ctx);
   }
   return 1;
@@ -2303,10 +2799,13 @@ static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
   bytes_left = ctx->selection_data.alloc - offset;
 
   bytes = read(fd, p, bytes_left);
+  sl_transfer_progress(&ctx->stats.wayland_to_x11_transfer, bytes);
   if (bytes == -1) {
     fprintf(stderr, "read error from data source: %m\n");
     sl_send_selection_notify(ctx, XCB_ATOM_NONE);
     ctx->selection_data_offer_receive_fd = -1;
+    sl_transfer_end(ctx, &ctx->stats.wayland_to_x11,
+                    &ctx->stats.wayland_to_x11_transfer);
     close(fd);
   } else {
     ctx->selection_data.size = offset + bytes;
@@ -2332,6 +2831,8 @@ static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
       }
       xcb_flush(ctx->connection);
       ctx->selection_data_offer_receive_fd = -1;
+      sl_transfer_end(ctx, &ctx->stats.wayland_to_x11,
+                      &ctx->stats.wayland_to_x11_transfer);
       close(fd);
     } else {
       ctx->selection_data.size = offset + bytes;
@@ -2463,6 +2964,30 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     if (wm_hints.flags & WM_HINTS_FLAG_URGENCY) {
       sl_request_attention(ctx, window, /*is_strong_request=*/false);
     }
+  } else if (event->atom ==
+             ctx->atoms[ATOM_NET_WM_SYNC_REQUEST_COUNTER].value) {
+    struct sl_window* window = sl_lookup_window(ctx, event->window);
+    xcb_sync_counter_t counter = 0;
+
+    // The counter is set up when the window is mapped, and replaced by the
+    // new one if the client changes it later.
+    if (!window || !window->managed)
+      return;
+
+    if (event->state != XCB_PROPERTY_DELETE) {
+      xcb_get_property_reply_t* reply = xcb_get_property_reply(
+          ctx->connection,
+          xcb_get_property(ctx->connection, 0, window->id,
+                           ctx->atoms[ATOM_NET_WM_SYNC_REQUEST_COUNTER].value,
+                           XCB_ATOM_ANY, 0, 2),
+          NULL);
+      if (reply) {
+        counter = sl_window_read_sync_counter(window, reply);
+        free(reply);
+      }
+    }
+
+    sl_window_setup_sync(window, window->sync_request ? counter : 0);
   } else if (event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
@@ -2548,6 +3073,8 @@ static void sl_handle_property_notify(struct sl_context* ctx,
         assert(!ctx->selection_send_event_source);
         close(ctx->selection_data_source_send_fd);
         ctx->selection_data_source_send_fd = -1;
+        sl_transfer_end(ctx, &ctx->stats.x11_to_wayland,
+                        &ctx->stats.x11_to_wayland_transfer);
         free(reply);
 
         sl_process_data_source_send_pending_list(ctx);
@@ -2823,6 +3350,7 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
     // If we got the atom name, then send the request to wayland and add our end
     // of the pipe to the wayland event loop.
     ctx->selection_data_offer_receive_fd = fd_to_receive;
+    sl_transfer_begin(ctx, &ctx->stats.wayland_to_x11_transfer);
     char* name = sl_copy_atom_name(atom_name_reply);
     wl_data_offer_receive(ctx->selection_data_offer->internal, name,
                           fd_to_wayland);
@@ -2909,70 +3437,210 @@ static void sl_handle_xfixes_selection_notify(
                         ctx->atoms[ATOM_WL_SELECTION].value, event->timestamp);
 }
 
+static void sl_handle_sync_alarm_notify(
+    struct sl_context* ctx, xcb_sync_alarm_notify_event_t* event) {
+  int64_t value = ((int64_t)event->counter_value.hi << 32) |
+                  event->counter_value.lo;
+  struct sl_window* window;
+
+  // Alarms are created before windows are paired with a surface.
+  wl_list_for_each(window, &ctx->windows, link) {
+    if (window->sync_alarm == event->alarm)
+      break;
+  }
+  if (&window->link == &ctx->windows) {
+    wl_list_for_each(window, &ctx->unpaired_windows, link) {
+      if (window->sync_alarm == event->alarm)
+        break;
+    }
+    if (&window->link == &ctx->unpaired_windows)
+      return;
+  }
+
+  window->sync_counter_value = value;
+  if (window->sync_pending && value >= window->sync_value) {
+    // Contents for the configure are acked when they are attached.
+    window->sync_pending = 0;
+    window->sync_drawn = 1;
+  }
+  if (window->frame_drawn_pending && !(value & 1))
+    sl_window_send_frame_drawn(window);
+}
+
+static void sl_handle_x_event(struct sl_context* ctx,
+                              xcb_generic_event_t* event) {
+  switch (event->response_type & ~SEND_EVENT_MASK) {
+    case XCB_CREATE_NOTIFY:
+      sl_handle_create_notify(ctx, (xcb_create_notify_event_t*)event);
+      break;
+    case XCB_DESTROY_NOTIFY:
+      sl_handle_destroy_notify(ctx, (xcb_destroy_notify_event_t*)event);
+      break;
+    case XCB_REPARENT_NOTIFY:
+      sl_handle_reparent_notify(ctx, (xcb_reparent_notify_event_t*)event);
+      break;
+    case XCB_MAP_REQUEST:
+      sl_handle_map_request(ctx, (xcb_map_request_event_t*)event);
+      break;
+    case XCB_MAP_NOTIFY:
+      sl_handle_map_notify(ctx, (xcb_map_notify_event_t*)event);
+      break;
+    case XCB_UNMAP_NOTIFY:
+      sl_handle_unmap_notify(ctx, (xcb_unmap_notify_event_t*)event);
+      break;
+    case XCB_CONFIGURE_REQUEST:
+      sl_handle_configure_request(ctx, (xcb_configure_request_event_t*)event);
+      break;
+    case XCB_CONFIGURE_NOTIFY:
+      sl_handle_configure_notify(ctx, (xcb_configure_notify_event_t*)event);
+      break;
+    case XCB_CLIENT_MESSAGE:
+      sl_handle_client_message(ctx, (xcb_client_message_event_t*)event);
+      break;
+    case XCB_FOCUS_IN:
+      sl_handle_focus_in(ctx, (xcb_focus_in_event_t*)event);
+      break;
+    case XCB_FOCUS_OUT:
+      sl_handle_focus_out(ctx, (xcb_focus_out_event_t*)event);
+      break;
+    case XCB_PROPERTY_NOTIFY:
+      sl_handle_property_notify(ctx, (xcb_property_notify_event_t*)event);
+      break;
+    case XCB_SELECTION_NOTIFY:
+      sl_handle_selection_notify(ctx, (xcb_selection_notify_event_t*)event);
+      break;
+    case XCB_SELECTION_REQUEST:
+      sl_handle_selection_request(ctx, (xcb_selection_request_event_t*)event);
+      break;
+  }
+
+  switch (event->response_type - ctx->xfixes_extension->first_event) {
+    case XCB_XFIXES_SELECTION_NOTIFY:
+      sl_handle_xfixes_selection_notify(
+          ctx, (xcb_xfixes_selection_notify_event_t*)event);
+      break;
+  }
+
+  if (ctx->sync_extension->present) {
+    switch (event->response_type - ctx->sync_extension->first_event) {
+      case XCB_SYNC_ALARM_NOTIFY:
+        sl_handle_sync_alarm_notify(ctx, (xcb_sync_alarm_notify_event_t*)event);
+        break;
+    }
+  }
+}
+
+// Returns true if |event| is superseded by one of the |count| |events| that
+// follow it in the same batch, and can be dropped without changing the
+// outcome of dispatching the batch.
+static int sl_x_event_superseded(struct sl_context* ctx,
+                                 xcb_generic_event_t* event,
+                                 xcb_generic_event_t** events,
+                                 int count) {
+  int i;
+
+  // Synthetic events are sent on purpose and always dispatched.
+  if (event->response_type & SEND_EVENT_MASK)
+    return 0;
+
+  switch (event->response_type) {
+    case XCB_PROPERTY_NOTIFY: {
+      xcb_property_notify_event_t* property =
+          (xcb_property_notify_event_t*)event;
+
+      // Each change is a step of the protocol for incremental transfers.
+      if (property->window == ctx->selection_window ||
+          property->window == ctx->selection_request.requestor)
+        return 0;
+
+      // Handlers fetch the current value of the property, so only the last
+      // notification for it needs to be dispatched. Window IDs can be reused
+      // once destroyed, which ends the search.
+      for (i = 0; i < count; ++i) {
+        if (events[i]->response_type == XCB_PROPERTY_NOTIFY) {
+          xcb_property_notify_event_t* later =
+              (xcb_property_notify_event_t*)events[i];
+
+          if (later->window == property->window &&
+              later->atom == property->atom)
+            return 1;
+        } else if (events[i]->response_type == XCB_DESTROY_NOTIFY) {
+          if (((xcb_destroy_notify_event_t*)events[i])->window ==
+              property->window)
+            return 0;
+        }
+      }
+    } break;
+    case XCB_CONFIGURE_NOTIFY: {
+      xcb_configure_notify_event_t* configure =
+          (xcb_configure_notify_event_t*)event;
+
+      // The handler only looks at the resulting geometry, so within a run
+      // of ConfigureNotify events the last one for each window is enough.
+      for (i = 0; i < count; ++i) {
+        xcb_configure_notify_event_t* later =
+            (xcb_configure_notify_event_t*)events[i];
+
+        if ((later->response_type & ~SEND_EVENT_MASK) != XCB_CONFIGURE_NOTIFY)
+          break;
+        if (later->response_type == XCB_CONFIGURE_NOTIFY &&
+            later->event == configure->event &&
+            later->window == configure->window)
+          return 1;
+      }
+    } break;
+    case XCB_FOCUS_IN:
+    case XCB_FOCUS_OUT: {
+      xcb_focus_in_event_t* focus = (xcb_focus_in_event_t*)event;
+
+      // Focus moving back and forth only needs its last change for each
+      // window to be dispatched.
+      for (i = 0; i < count; ++i) {
+        if (events[i]->response_type == XCB_FOCUS_IN ||
+            events[i]->response_type == XCB_FOCUS_OUT) {
+          if (((xcb_focus_in_event_t*)events[i])->event == focus->event)
+            return 1;
+        } else if (events[i]->response_type == XCB_DESTROY_NOTIFY) {
+          if (((xcb_destroy_notify_event_t*)events[i])->window ==
+              focus->event)
+            return 0;
+        }
+      }
+    } break;
+  }
+
+  return 0;
+}
+
 static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
-  xcb_generic_event_t* event;
+  xcb_generic_event_t* events[X_EVENT_BATCH_SIZE];
   uint32_t count = 0;
+  int n, i;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR))
     return 0;
 
-  while ((event = xcb_poll_for_event(ctx->connection))) {
-    switch (event->response_type & ~SEND_EVENT_MASK) {
-      case XCB_CREATE_NOTIFY:
-        sl_handle_create_notify(ctx, (xcb_create_notify_event_t*)event);
-        break;
-      case XCB_DESTROY_NOTIFY:
-        sl_handle_destroy_notify(ctx, (xcb_destroy_notify_event_t*)event);
-        break;
-      case XCB_REPARENT_NOTIFY:
-        sl_handle_reparent_notify(ctx, (xcb_reparent_notify_event_t*)event);
-        break;
-      case XCB_MAP_REQUEST:
-        sl_handle_map_request(ctx, (xcb_map_request_event_t*)event);
-        break;
-      case XCB_MAP_NOTIFY:
-        sl_handle_map_notify(ctx, (xcb_map_notify_event_t*)event);
-        break;
-      case XCB_UNMAP_NOTIFY:
-        sl_handle_unmap_notify(ctx, (xcb_unmap_notify_event_t*)event);
-        break;
-      case XCB_CONFIGURE_REQUEST:
-        sl_handle_configure_request(ctx, (xcb_configure_request_event_t*)event);
-        break;
-      case XCB_CONFIGURE_NOTIFY:
-        sl_handle_configure_notify(ctx, (xcb_configure_notify_event_t*)event);
-        break;
-      case XCB_CLIENT_MESSAGE:
-        sl_handle_client_message(ctx, (xcb_client_message_event_t*)event);
-        break;
-      case XCB_FOCUS_IN:
-        sl_handle_focus_in(ctx, (xcb_focus_in_event_t*)event);
-        break;
-      case XCB_FOCUS_OUT:
-        sl_handle_focus_out(ctx, (xcb_focus_out_event_t*)event);
-        break;
-      case XCB_PROPERTY_NOTIFY:
-        sl_handle_property_notify(ctx, (xcb_property_notify_event_t*)event);
-        break;
-      case XCB_SELECTION_NOTIFY:
-        sl_handle_selection_notify(ctx, (xcb_selection_notify_event_t*)event);
-        break;
-      case XCB_SELECTION_REQUEST:
-        sl_handle_selection_request(ctx, (xcb_selection_request_event_t*)event);
-        break;
-    }
+  // Pending events are drained before any of them is dispatched, so that
+  // events superseded by later ones in the same batch can be dropped.
+  // Whether an event is superseded is decided right before it would be
+  // dispatched, as earlier handlers can change the outcome.
+  do {
+    n = 0;
+    while (n < X_EVENT_BATCH_SIZE &&
+           (events[n] = xcb_poll_for_event(ctx->connection)))
+      ++n;
 
-    switch (event->response_type - ctx->xfixes_extension->first_event) {
-      case XCB_XFIXES_SELECTION_NOTIFY:
-        sl_handle_xfixes_selection_notify(
-            ctx, (xcb_xfixes_selection_notify_event_t*)event);
-        break;
+    for (i = 0; i < n; ++i) {
+      if (sl_x_event_superseded(ctx, events[i], events + i + 1, n - i - 1))
+        ++ctx->stats.x_events_compressed;
+      else
+        sl_handle_x_event(ctx, events[i]);
+      free(events[i]);
     }
-
-    free(event);
-    ++count;
-  }
+    ctx->stats.x_events += n;
+    count += n;
+  } while (n);
 
   if ((mask & ~WL_EVENT_WRITABLE) == 0)
     xcb_flush(ctx->connection);
@@ -2989,6 +3657,8 @@ static void sl_set_supported(struct sl_context* ctx) {
       ctx->atoms[ATOM_NET_WM_STATE_FULLSCREEN].value,
       ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_VERT].value,
       ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_HORZ].value,
+      ctx->atoms[ATOM_NET_WM_SYNC_REQUEST].value,
+      ctx->atoms[ATOM_NET_WM_FRAME_DRAWN].value,
       // TODO(hollingum): STATE_MODAL and CLIENT_LIST, based on what wlroots
       // has.
   };
@@ -3017,6 +3687,7 @@ static void sl_connect(struct sl_context* ctx) {
 
   xcb_prefetch_extension_data(ctx->connection, &xcb_xfixes_id);
   xcb_prefetch_extension_data(ctx->connection, &xcb_composite_id);
+  xcb_prefetch_extension_data(ctx->connection, &xcb_sync_id);
 
   for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
     const char* name = ctx->atoms[i].name;
@@ -3053,6 +3724,16 @@ static void sl_connect(struct sl_context* ctx) {
   assert(xfixes_query_version_reply->major_version >= 5);
   free(xfixes_query_version_reply);
 
+  // Sync is optional. Without it, configures are acked based on size.
+  ctx->sync_extension = xcb_get_extension_data(ctx->connection, &xcb_sync_id);
+  if (ctx->sync_extension->present) {
+    free(xcb_sync_initialize_reply(
+        ctx->connection,
+        xcb_sync_initialize(ctx->connection, XCB_SYNC_MAJOR_VERSION,
+                            XCB_SYNC_MINOR_VERSION),
+        NULL));
+  }
+
   composite_extension =
       xcb_get_extension_data(ctx->connection, &xcb_composite_id);
   assert(composite_extension->present);
@@ -3287,7 +3968,9 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   display_name[bytes_read] = '\0';
   setenv("DISPLAY", display_name, 1);
 
+  sl_stats_startup_phase(ctx, SL_STARTUP_PHASE_XWAYLAND_READY);
   sl_connect(ctx);
+  sl_stats_startup_phase(ctx, SL_STARTUP_PHASE_CONNECT);
 
   wl_event_source_remove(ctx->display_ready_event_source);
   ctx->display_ready_event_source = NULL;
@@ -3442,6 +4125,398 @@ static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
   return 1;
 }
 
+const char* sl_shm_driver_name(int shm_driver) {
+  switch (shm_driver) {
+    case SHM_DRIVER_NOOP:
+      return "noop";
+    case SHM_DRIVER_DMABUF:
+      return "dmabuf";
+    case SHM_DRIVER_VIRTWL:
+      return "virtwl";
+    case SHM_DRIVER_VIRTWL_DMABUF:
+      return "virtwl-dmabuf";
+    case SHM_DRIVER_STREAM:
+      return "stream";
+  }
+  assert(0);
+  return NULL;
+}
+
+// Allocates and maps a calibration buffer the same way the given driver
+// allocates intermediate buffers. Returns NULL if the driver can't be used.
+static struct sl_mmap* sl_shm_driver_calibration_buffer_create(
+    struct sl_context* ctx, int shm_driver) {
+  size_t width = SHM_DRIVER_CALIBRATION_WIDTH;
+  size_t height = SHM_DRIVER_CALIBRATION_HEIGHT;
+
+  switch (shm_driver) {
+    case SHM_DRIVER_DMABUF: {
+      struct sl_mmap* map;
+      struct gbm_bo* bo;
+      int stride;
+
+      if (!ctx->gbm) {
+        size_t heap_stride;
+        int fd;
+
+        if (ctx->dma_heap_fd == -1)
+          return NULL;
+
+        fd = sl_dma_heap_alloc(ctx, width, height, 4, &heap_stride);
+        if (fd == -1)
+          return NULL;
+
+        map = sl_mmap_create(fd, height * heap_stride, 4, 1, 0, heap_stride,
+                             0, 0, 1, 0);
+        map->begin_write = sl_dmabuf_begin_write;
+        map->end_write = sl_dmabuf_end_write;
+        return map;
+      }
+
+      bo = gbm_bo_create(ctx->gbm, width, height, GBM_FORMAT_XRGB8888,
+                         GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+      if (!bo)
+        return NULL;
+
+      stride = gbm_bo_get_stride(bo);
+      map = sl_mmap_create(gbm_bo_get_fd(bo), height * stride, 4, 1, 0, stride,
+                           0, 0, 1, 0);
+      map->begin_write = sl_dmabuf_begin_write;
+      map->end_write = sl_dmabuf_end_write;
+      gbm_bo_destroy(bo);
+      return map;
+    }
+    case SHM_DRIVER_VIRTWL: {
+      struct virtwl_ioctl_new ioctl_new = {.type = VIRTWL_IOCTL_NEW_ALLOC,
+                                           .fd = -1,
+                                           .flags = 0,
+                                           .size = width * height * 4};
+
+      if (ctx->virtwl_fd == -1 ||
+          ioctl(ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new)) {
+        return NULL;
+      }
+
+      return sl_mmap_create(ioctl_new.fd, width * height * 4, 4, 1, 0,
+                            width * 4, 0, 0, 1, 0);
+    }
+    case SHM_DRIVER_VIRTWL_DMABUF: {
+      struct virtwl_ioctl_new ioctl_new = {
+          .type = VIRTWL_IOCTL_NEW_DMABUF,
+          .fd = -1,
+          .flags = 0,
+          .dmabuf = {.width = width,
+                     .height = height,
+                     .format = WL_DRM_FORMAT_XRGB8888}};
+      struct sl_mmap* map;
+
+      if (ctx->virtwl_fd == -1 ||
+          ioctl(ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new)) {
+        return NULL;
+      }
+
+      map = sl_mmap_create(ioctl_new.fd, ioctl_new.dmabuf.stride0 * height, 4,
+                           1, ioctl_new.dmabuf.offset0,
+                           ioctl_new.dmabuf.stride0, 0, 0, 1, 0);
+      map->begin_write = sl_virtwl_dmabuf_begin_write;
+      map->end_write = sl_virtwl_dmabuf_end_write;
+      return map;
+    }
+  }
+  return NULL;
+}
+
+static void sl_shm_driver_calibration_sync_done(void* data,
+                                                struct wl_callback* callback,
+                                                uint32_t time) {
+  int* done = (int*)data;
+
+  *done = 1;
+  wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener
+    sl_shm_driver_calibration_sync_listener = {
+        sl_shm_driver_calibration_sync_done};
+
+// Runs the event loop until the host has handled everything sent so far.
+// wl_display_roundtrip() would deadlock, as the host connection can be
+// forwarded through virtwl by the event loop. Returns 0 on timeout.
+static int sl_shm_driver_calibration_sync(struct sl_context* ctx) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  struct wl_callback* callback = wl_display_sync(ctx->display);
+  uint64_t start_us = sl_now_us();
+  int done = 0;
+
+  wl_callback_add_listener(callback, &sl_shm_driver_calibration_sync_listener,
+                           &done);
+  while (!done) {
+    if (sl_now_us() - start_us > SHM_DRIVER_CALIBRATION_TIMEOUT_US) {
+      wl_callback_destroy(callback);
+      return 0;
+    }
+    wl_display_flush(ctx->display);
+    wl_event_loop_dispatch(event_loop, 100);
+  }
+
+  return 1;
+}
+
+static void sl_shm_driver_calibration_buffer_created(
+    void* data,
+    struct zwp_linux_buffer_params_v1* params,
+    struct wl_buffer* buffer) {
+  struct wl_buffer** created = (struct wl_buffer**)data;
+
+  *created = buffer;
+}
+
+static void sl_shm_driver_calibration_buffer_failed(
+    void* data, struct zwp_linux_buffer_params_v1* params) {}
+
+static const struct zwp_linux_buffer_params_v1_listener
+    sl_shm_driver_calibration_buffer_listener = {
+        sl_shm_driver_calibration_buffer_created,
+        sl_shm_driver_calibration_buffer_failed};
+
+// Creates a host buffer for |map| the same way the given driver does for
+// intermediate buffers. Dmabuf imports can fail, so they are done with a
+// params create request instead of create_immed, which would make a failed
+// import fatal. Returns NULL if the host can't use the buffer.
+static struct wl_buffer* sl_shm_driver_calibration_buffer_submit(
+    struct sl_context* ctx, int shm_driver, struct sl_mmap* map) {
+  struct zwp_linux_buffer_params_v1* params;
+  struct wl_buffer* buffer = NULL;
+
+  if (shm_driver == SHM_DRIVER_VIRTWL) {
+    struct wl_shm_pool* pool;
+
+    if (!ctx->shm)
+      return NULL;
+
+    pool = wl_shm_create_pool(ctx->shm->internal, map->fd, map->size);
+    buffer = wl_shm_pool_create_buffer(
+        pool, 0, SHM_DRIVER_CALIBRATION_WIDTH, SHM_DRIVER_CALIBRATION_HEIGHT,
+        map->stride[0], WL_SHM_FORMAT_XRGB8888);
+    wl_shm_pool_destroy(pool);
+    if (!sl_shm_driver_calibration_sync(ctx)) {
+      wl_buffer_destroy(buffer);
+      return NULL;
+    }
+    return buffer;
+  }
+
+  if (!ctx->linux_dmabuf)
+    return NULL;
+
+  params = zwp_linux_dmabuf_v1_create_params(ctx->linux_dmabuf->internal);
+  zwp_linux_buffer_params_v1_add(params, map->fd, 0, map->offset[0],
+                                 map->stride[0], 0, 0);
+  zwp_linux_buffer_params_v1_add_listener(
+      params, &sl_shm_driver_calibration_buffer_listener, &buffer);
+  zwp_linux_buffer_params_v1_create(params, SHM_DRIVER_CALIBRATION_WIDTH,
+                                    SHM_DRIVER_CALIBRATION_HEIGHT,
+                                    WL_DRM_FORMAT_XRGB8888, 0);
+
+  // The created or failed event is sent before the sync is done. Events
+  // are no longer delivered once the params object is destroyed.
+  sl_shm_driver_calibration_sync(ctx);
+  zwp_linux_buffer_params_v1_destroy(params);
+  return buffer;
+}
+
+// Returns the time in microseconds it takes to allocate one intermediate
+// buffer with the given driver, fill it a few times and have the host take
+// it, or 0 if the driver is not available. Fills are bracketed by the same
+// sync calls as the copy path, as those flush caches for dmabufs.
+static uint64_t sl_shm_driver_calibrate(struct sl_context* ctx,
+                                        int shm_driver,
+                                        const uint8_t* src) {
+  size_t bytes = SHM_DRIVER_CALIBRATION_WIDTH * 4;
+  uint64_t start_us, copy_us, submit_us, end_us;
+  struct wl_buffer* buffer;
+  struct sl_mmap* map;
+  int i, y;
+
+  start_us = sl_now_us();
+  map = sl_shm_driver_calibration_buffer_create(ctx, shm_driver);
+  if (!map)
+    return 0;
+
+  copy_us = sl_now_us();
+  for (i = 0; i < SHM_DRIVER_CALIBRATION_ITERATIONS; ++i) {
+    uint8_t* dst = (uint8_t*)map->addr + map->offset[0];
+
+    if (map->begin_write)
+      map->begin_write(map->fd);
+    for (y = 0; y < SHM_DRIVER_CALIBRATION_HEIGHT; ++y) {
+      memcpy(dst, src + y * bytes, bytes);
+      dst += map->stride[0];
+    }
+    if (map->end_write)
+      map->end_write(map->fd);
+  }
+
+  submit_us = sl_now_us();
+  buffer = sl_shm_driver_calibration_buffer_submit(ctx, shm_driver, map);
+  end_us = sl_now_us();
+  sl_mmap_unref(map);
+  if (!buffer) {
+    fprintf(stderr, "shm driver calibration: %s: rejected by host\n",
+            sl_shm_driver_name(shm_driver));
+    return 0;
+  }
+  wl_buffer_destroy(buffer);
+
+  fprintf(stderr,
+          "shm driver calibration: %s: alloc=%" PRIu64 "us copy=%.1fMB/s "
+          "submit=%" PRIu64 "us\n",
+          sl_shm_driver_name(shm_driver), copy_us - start_us,
+          (double)bytes * SHM_DRIVER_CALIBRATION_HEIGHT *
+              SHM_DRIVER_CALIBRATION_ITERATIONS / MAX(submit_us - copy_us, 1),
+          end_us - submit_us);
+
+  return MAX(end_us - start_us, 1);
+}
+
+// Returns the key that a cached calibration is valid for. Driver
+// performance depends on the machine, the kernel and the devices used to
+// allocate buffers, including the kernel driver behind the DRM device.
+static char* sl_shm_driver_cache_key(struct sl_context* ctx) {
+  char machine_id[64] = "unknown";
+  const char* drm_driver = "none";
+  drmVersionPtr version = NULL;
+  struct utsname uts;
+  FILE* file;
+  char* key;
+
+  file = fopen("/etc/machine-id", "r");
+  if (file) {
+    if (fscanf(file, "%63s", machine_id) != 1)
+      strcpy(machine_id, "unknown");
+    fclose(file);
+  }
+
+  if (uname(&uts))
+    strcpy(uts.release, "unknown");
+
+  if (ctx->gbm) {
+    version = drmGetVersion(gbm_device_get_fd(ctx->gbm));
+    if (version)
+      drm_driver = version->name;
+  }
+
+  key = sl_xasprintf("%s:%s:%s:%s", machine_id, uts.release,
+                     ctx->drm_device
+                         ? ctx->drm_device
+                         : ctx->dma_heap_fd != -1 ? "dma-heap" : "none",
+                     drm_driver);
+  if (version)
+    drmFreeVersion(version);
+  return key;
+}
+
+// Returns the shm driver cached by an earlier calibration on this machine,
+// or -1 if there is none and sl_select_shm_driver() has to be used once the
+// host connection is up.
+static int sl_cached_shm_driver(struct sl_context* ctx,
+                                const char* runtime_dir) {
+  const int candidates[] = {SHM_DRIVER_VIRTWL_DMABUF, SHM_DRIVER_VIRTWL,
+                            SHM_DRIVER_DMABUF};
+  char cached_key[512], cached_driver[32];
+  int shm_driver = -1;
+  char* cache_path;
+  FILE* file;
+  char* key;
+  size_t i;
+
+  // Client pools can be forwarded as-is unless the host connection goes
+  // through a virtwl context. Nothing beats not copying at all.
+  if (ctx->virtwl_socket_fd == -1)
+    return SHM_DRIVER_NOOP;
+
+  key = sl_shm_driver_cache_key(ctx);
+  cache_path = sl_xasprintf("%s/%s", runtime_dir, SHM_DRIVER_CACHE_NAME);
+
+  file = fopen(cache_path, "r");
+  if (file) {
+    if (fscanf(file, "%511s %31s", cached_key, cached_driver) == 2 &&
+        !strcmp(cached_key, key)) {
+      for (i = 0; i < ARRAY_SIZE(candidates); ++i) {
+        if (!strcmp(cached_driver, sl_shm_driver_name(candidates[i])))
+          shm_driver = candidates[i];
+      }
+    }
+    fclose(file);
+  }
+
+  if (shm_driver != -1) {
+    fprintf(stderr, "shm driver: using %s\n",
+            sl_shm_driver_name(shm_driver));
+  }
+
+  free(cache_path);
+  free(key);
+  return shm_driver;
+}
+
+// Selects the fastest shm driver available on this machine by timing each
+// of them, from allocation to the host having taken a buffer. The result is
+// cached in the runtime directory and keyed by sl_shm_driver_cache_key().
+// This has to run before any client is connected, as the driver decides
+// how client shm globals are bound.
+static int sl_select_shm_driver(struct sl_context* ctx,
+                                const char* runtime_dir) {
+  const int candidates[] = {SHM_DRIVER_VIRTWL_DMABUF, SHM_DRIVER_VIRTWL,
+                            SHM_DRIVER_DMABUF};
+  size_t size =
+      SHM_DRIVER_CALIBRATION_WIDTH * SHM_DRIVER_CALIBRATION_HEIGHT * 4;
+  int shm_driver = SHM_DRIVER_NOOP;
+  uint64_t best_us = 0;
+  uint8_t* src;
+  FILE* file;
+  size_t i;
+
+  // Globals that buffers are submitted through must be bound first. The
+  // default driver is used without calibration if the host doesn't respond.
+  if (!sl_shm_driver_calibration_sync(ctx)) {
+    fprintf(stderr, "error: shm driver calibration: host not responding\n");
+    return ctx->drm_device ? SHM_DRIVER_DMABUF : SHM_DRIVER_VIRTWL_DMABUF;
+  }
+
+  src = malloc(size);
+  assert(src);
+  memset(src, 0x80, size);
+
+  for (i = 0; i < ARRAY_SIZE(candidates); ++i) {
+    uint64_t time_us = sl_shm_driver_calibrate(ctx, candidates[i], src);
+
+    if (time_us && (!best_us || time_us < best_us)) {
+      shm_driver = candidates[i];
+      best_us = time_us;
+    }
+  }
+  free(src);
+
+  if (best_us) {
+    char* cache_path =
+        sl_xasprintf("%s/%s", runtime_dir, SHM_DRIVER_CACHE_NAME);
+    char* key = sl_shm_driver_cache_key(ctx);
+
+    file = fopen(cache_path, "w");
+    if (file) {
+      fprintf(file, "%s %s\n", key, sl_shm_driver_name(shm_driver));
+      fclose(file);
+    }
+    free(cache_path);
+    free(key);
+  }
+
+  fprintf(stderr, "shm driver: using %s\n", sl_shm_driver_name(shm_driver));
+  return shm_driver;
+}
+
 // Break |str| into a sequence of zero or more nonempty arguments. No more
 // than |argc| arguments will be added to |argv|. Returns the total number of
 // argments found in |str|.
@@ -3491,7 +4566,9 @@ static void sl_print_usage() {
       "  --master\t\t\tRun as master and spawn child processes\n"
       "  --socket=SOCKET\t\tName of socket to listen on\n"
       "  --display=DISPLAY\t\tWayland display to connect to\n"
-      "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, virtwl)\n"
+      "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, virtwl, "
+      "stream, auto)\n"
+      "  --shm-hybrid\t\t\tForward shareable pools without copying\n"
       "  --data-driver=DRIVER\t\tData driver to use (noop, virtwl)\n"
       "  --scale=SCALE\t\t\tScale factor for contents\n"
       "  --dpi=[DPI[,DPI...]]\t\tDPI buckets\n"
@@ -3507,7 +4584,17 @@ static void sl_print_usage() {
       "  --frame-color=COLOR\t\tWindow frame color for X11 clients\n"
       "  --virtwl-device=DEVICE\tVirtWL device to use\n"
       "  --drm-device=DEVICE\t\tDRM device to use\n"
-      "  --glamor\t\t\tUse glamor to accelerate X11 clients\n");
+      "  --dma-heap=PATH\t\tDMA heap to use without DRM device\n"
+      "  --glamor\t\t\tUse glamor to accelerate X11 clients\n"
+      "  --stats-interval=SECONDS\tReport startup, latency and memory stats\n"
+      "  --idle-trim-timeout=SECONDS\tFree buffers of idle surfaces\n"
+      "  --profiles=PATH\t\tPer-application performance profiles\n"
+      "  --damage-stream=FD\t\tWrite damaged contents to stream\n"
+      "  --verify-copy=N\t\tVerify every Nth copy of contents\n"
+      "  --verify-copy-fallback\tCopy in full after a failed verify\n"
+      "  --host-probe-interval=MS\tHost latency probe interval\n"
+      "  --perf-counters\t\tReport CPU counters for the copy path\n"
+      "  --no-memory-pressure\t\tDon't release memory under pressure\n");
 }
 
 static const char* sl_arg_value(const char* arg) {
@@ -3533,6 +4620,7 @@ int main(int argc, char** argv) {
       .xdg_shell = NULL,
       .aura_shell = NULL,
       .viewporter = NULL,
+      .presentation = NULL,
       .linux_dmabuf = NULL,
       .keyboard_extension = NULL,
       .text_input_manager = NULL,
@@ -3540,6 +4628,13 @@ int main(int argc, char** argv) {
       .display_ready_event_source = NULL,
       .sigchld_event_source = NULL,
       .shm_driver = SHM_DRIVER_NOOP,
+      .shm_hybrid = 0,
+      .idle_trim_timeout = IDLE_TRIM_TIMEOUT,
+      .idle_trim_event_source = NULL,
+      .verify_copy_interval = 0,
+      .verify_copy_fallback = 0,
+      .verify_copy_count = 0,
+      .output_settle_event_source = NULL,
       .data_driver = DATA_DRIVER_NOOP,
       .wm_fd = -1,
       .virtwl_fd = -1,
@@ -3549,6 +4644,7 @@ int main(int argc, char** argv) {
       .virtwl_socket_event_source = NULL,
       .drm_device = NULL,
       .gbm = NULL,
+      .dma_heap_fd = -1,
       .xwayland = 0,
       .xwayland_pid = -1,
       .child_pid = -1,
@@ -3558,6 +4654,7 @@ int main(int argc, char** argv) {
       .connection = NULL,
       .connection_event_source = NULL,
       .xfixes_extension = NULL,
+      .sync_extension = NULL,
       .screen = NULL,
       .window = 0,
       .host_focus_window = NULL,
@@ -3611,6 +4708,11 @@ int main(int argc, char** argv) {
                   {"_NET_WM_STATE_MAXIMIZED_VERT"},
               [ATOM_NET_WM_STATE_MAXIMIZED_HORZ] =
                   {"_NET_WM_STATE_MAXIMIZED_HORZ"},
+              [ATOM_NET_WM_SYNC_REQUEST] = {"_NET_WM_SYNC_REQUEST"},
+              [ATOM_NET_WM_SYNC_REQUEST_COUNTER] =
+                  {"_NET_WM_SYNC_REQUEST_COUNTER"},
+              [ATOM_NET_WM_FRAME_DRAWN] = {"_NET_WM_FRAME_DRAWN"},
+              [ATOM_NET_WM_FRAME_TIMINGS] = {"_NET_WM_FRAME_TIMINGS"},
               [ATOM_CLIPBOARD] = {"CLIPBOARD"},
               [ATOM_CLIPBOARD_MANAGER] = {"CLIPBOARD_MANAGER"},
               [ATOM_TARGETS] = {"TARGETS"},
@@ -3621,7 +4723,11 @@ int main(int argc, char** argv) {
               [ATOM_GTK_THEME_VARIANT] = {"_GTK_THEME_VARIANT"},
           },
       .visual_ids = {0},
-      .colormaps = {0}};
+      .colormaps = {0},
+      .stats = {.start_us = sl_now_us()},
+      .memory_pressure = {.fd = -1},
+      .stream = {.fd = -1},
+      .perf = {.fd = -1}};
   const char* display = getenv("SOMMELIER_DISPLAY");
   const char* scale = getenv("SOMMELIER_SCALE");
   const char* dpi = getenv("SOMMELIER_DPI");
@@ -3630,6 +4736,7 @@ int main(int argc, char** argv) {
   const char* dark_frame_color = getenv("SOMMELIER_DARK_FRAME_COLOR");
   const char* virtwl_device = getenv("SOMMELIER_VIRTWL_DEVICE");
   const char* drm_device = getenv("SOMMELIER_DRM_DEVICE");
+  const char* dma_heap = getenv("SOMMELIER_DMA_HEAP");
   const char* glamor = getenv("SOMMELIER_GLAMOR");
   const char* shm_driver = getenv("SOMMELIER_SHM_DRIVER");
   const char* data_driver = getenv("SOMMELIER_DATA_DRIVER");
@@ -3641,8 +4748,17 @@ int main(int argc, char** argv) {
       getenv("SOMMELIER_XWAYLAND_GL_DRIVER_PATH");
   const char* xauth_path = getenv("SOMMELIER_XAUTH_PATH");
   const char* xfont_path = getenv("SOMMELIER_XFONT_PATH");
+  const char* stats_interval = getenv("SOMMELIER_STATS_INTERVAL");
+  const char* idle_trim_timeout = getenv("SOMMELIER_IDLE_TRIM_TIMEOUT");
+  const char* profiles = getenv("SOMMELIER_PROFILES");
+  const char* damage_stream = getenv("SOMMELIER_DAMAGE_STREAM");
+  const char* verify_copy = getenv("SOMMELIER_VERIFY_COPY");
+  const char* host_probe_interval = getenv("SOMMELIER_HOST_PROBE_INTERVAL");
+  const char* perf_counters = getenv("SOMMELIER_PERF_COUNTERS");
+  const char* memory_pressure = getenv("SOMMELIER_MEMORY_PRESSURE");
   const char* socket_name = "wayland-0";
   const char* runtime_dir;
+  int calibrate_shm_driver = 0;
   struct wl_event_loop* event_loop;
   struct wl_listener client_destroy_listener = {.notify =
                                                     sl_client_destroy_notify};
@@ -3674,6 +4790,8 @@ int main(int argc, char** argv) {
       display = sl_arg_value(arg);
     } else if (strstr(arg, "--shm-driver") == arg) {
       shm_driver = sl_arg_value(arg);
+    } else if (strstr(arg, "--shm-hybrid") == arg) {
+      ctx.shm_hybrid = 1;
     } else if (strstr(arg, "--data-driver") == arg) {
       data_driver = sl_arg_value(arg);
     } else if (strstr(arg, "--peer-pid") == arg) {
@@ -3716,12 +4834,32 @@ int main(int argc, char** argv) {
       virtwl_device = sl_arg_value(arg);
     } else if (strstr(arg, "--drm-device") == arg) {
       drm_device = sl_arg_value(arg);
+    } else if (strstr(arg, "--dma-heap") == arg) {
+      dma_heap = sl_arg_value(arg);
     } else if (strstr(arg, "--glamor") == arg) {
       glamor = "1";
     } else if (strstr(arg, "--x-auth") == arg) {
       xauth_path = sl_arg_value(arg);
     } else if (strstr(arg, "--x-font-path") == arg) {
       xfont_path = sl_arg_value(arg);
+    } else if (strstr(arg, "--stats-interval") == arg) {
+      stats_interval = sl_arg_value(arg);
+    } else if (strstr(arg, "--idle-trim-timeout") == arg) {
+      idle_trim_timeout = sl_arg_value(arg);
+    } else if (strstr(arg, "--profiles") == arg) {
+      profiles = sl_arg_value(arg);
+    } else if (strstr(arg, "--damage-stream") == arg) {
+      damage_stream = sl_arg_value(arg);
+    } else if (strstr(arg, "--verify-copy-fallback") == arg) {
+      ctx.verify_copy_fallback = 1;
+    } else if (strstr(arg, "--verify-copy") == arg) {
+      verify_copy = sl_arg_value(arg);
+    } else if (strstr(arg, "--host-probe-interval") == arg) {
+      host_probe_interval = sl_arg_value(arg);
+    } else if (strstr(arg, "--perf-counters") == arg) {
+      perf_counters = "1";
+    } else if (strstr(arg, "--no-memory-pressure") == arg) {
+      memory_pressure = "0";
     } else if (arg[0] == '-') {
       if (strcmp(arg, "--") == 0) {
         ctx.runprog = &argv[i + 1];
@@ -3864,8 +5002,17 @@ int main(int argc, char** argv) {
               strstr(arg, "--accelerators") == arg ||
               strstr(arg, "--virtwl-device") == arg ||
               strstr(arg, "--drm-device") == arg ||
+              strstr(arg, "--dma-heap") == arg ||
               strstr(arg, "--shm-driver") == arg ||
-              strstr(arg, "--data-driver") == arg) {
+              strstr(arg, "--shm-hybrid") == arg ||
+              strstr(arg, "--data-driver") == arg ||
+              strstr(arg, "--stats-interval") == arg ||
+              strstr(arg, "--idle-trim-timeout") == arg ||
+              strstr(arg, "--profiles") == arg ||
+              strstr(arg, "--verify-copy") == arg ||
+              strstr(arg, "--host-probe-interval") == arg ||
+              strstr(arg, "--perf-counters") == arg ||
+              strstr(arg, "--no-memory-pressure") == arg) {
             args[i++] = arg;
           }
         }
@@ -3929,6 +5076,27 @@ int main(int argc, char** argv) {
 
   event_loop = wl_display_get_event_loop(ctx.host_display);
 
+  if (stats_interval && atoi(stats_interval) > 0)
+    sl_stats_init(&ctx, atoi(stats_interval));
+
+  // Counters are reported along with other stats.
+  if (ctx.stats.interval && perf_counters && strcmp(perf_counters, "0"))
+    sl_perf_init(&ctx);
+
+  if (idle_trim_timeout)
+    ctx.idle_trim_timeout = atoi(idle_trim_timeout);
+  if (ctx.idle_trim_timeout > 0)
+    sl_idle_trim_init(&ctx);
+
+  if (!memory_pressure || strcmp(memory_pressure, "0"))
+    sl_memory_pressure_init(&ctx);
+
+  if (damage_stream)
+    sl_stream_init(&ctx, atoi(damage_stream));
+
+  if (verify_copy)
+    ctx.verify_copy_interval = MAX(0, atoi(verify_copy));
+
   if (!virtwl_device)
     virtwl_device = VIRTWL_DEVICE;
 
@@ -3994,15 +5162,63 @@ int main(int argc, char** argv) {
     }
 
     ctx.drm_device = drm_device;
+  } else {
+    // Linear dmabufs for the dmabuf driver can be allocated from a DMA heap
+    // when there's no DRM device to allocate them with.
+    ctx.dma_heap_fd =
+        open(dma_heap ? dma_heap : DMA_HEAP_PATH, O_RDWR | O_CLOEXEC);
+    if (ctx.dma_heap_fd == -1 && dma_heap) {
+      fprintf(stderr, "error: could not open %s (%s)\n", dma_heap,
+              strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  wl_list_init(&ctx.profiles);
+  if (profiles) {
+    sl_profiles_load(&ctx, profiles);
+  } else {
+    const char* config_home = getenv("XDG_CONFIG_HOME");
+    const char* home = getenv("HOME");
+    char* profiles_path = NULL;
+
+    if (config_home)
+      profiles_path = sl_xasprintf("%s/%s", config_home, PROFILES_PATH);
+    else if (home)
+      profiles_path = sl_xasprintf("%s/.config/%s", home, PROFILES_PATH);
+    if (profiles_path) {
+      sl_profiles_load(&ctx, profiles_path);
+      free(profiles_path);
+    }
+  }
+
+  // The driver is set up before any window exists, so only the profile of
+  // the forced application ID can choose it. Explicit options take
+  // precedence.
+  if (!shm_driver) {
+    struct sl_profile* profile = sl_profile_find(&ctx, NULL);
+
+    if (profile && profile->shm_driver)
+      shm_driver = profile->shm_driver;
   }
 
   if (!shm_driver)
     shm_driver = ctx.xwayland ? XWAYLAND_SHM_DRIVER : SHM_DRIVER;
 
   if (shm_driver) {
-    if (strcmp(shm_driver, "dmabuf") == 0) {
-      if (!ctx.drm_device) {
-        fprintf(stderr, "error: need drm device for dmabuf driver\n");
+    if (strcmp(shm_driver, "auto") == 0) {
+      // Without a cached result, drivers are calibrated once the host
+      // connection is up, as the time it takes the host to take a buffer
+      // is part of their cost.
+      ctx.shm_driver = sl_cached_shm_driver(&ctx, runtime_dir);
+      if (ctx.shm_driver == -1) {
+        ctx.shm_driver = SHM_DRIVER_NOOP;
+        calibrate_shm_driver = 1;
+      }
+    } else if (strcmp(shm_driver, "dmabuf") == 0) {
+      if (!ctx.drm_device && ctx.dma_heap_fd == -1) {
+        fprintf(stderr,
+                "error: need drm device or dma heap for dmabuf driver\n");
         return EXIT_FAILURE;
       }
       ctx.shm_driver = SHM_DRIVER_DMABUF;
@@ -4039,6 +5255,12 @@ int main(int argc, char** argv) {
           close(new_dmabuf.fd);
         }
       }
+    } else if (strcmp(shm_driver, "stream") == 0) {
+      if (ctx.stream.fd == -1) {
+        fprintf(stderr, "error: need damage stream for stream driver\n");
+        return EXIT_FAILURE;
+      }
+      ctx.shm_driver = SHM_DRIVER_STREAM;
     }
   } else if (ctx.drm_device) {
     ctx.shm_driver = SHM_DRIVER_DMABUF;
@@ -4046,6 +5268,12 @@ int main(int argc, char** argv) {
     ctx.shm_driver = SHM_DRIVER_VIRTWL_DMABUF;
   }
 
+  if (ctx.shm_driver != SHM_DRIVER_DMABUF && ctx.dma_heap_fd != -1 &&
+      !calibrate_shm_driver) {
+    close(ctx.dma_heap_fd);
+    ctx.dma_heap_fd = -1;
+  }
+
   if (data_driver) {
     if (strcmp(data_driver, "virtwl") == 0) {
       if (ctx.virtwl_fd == -1) {
@@ -4112,8 +5340,19 @@ int main(int argc, char** argv) {
   wl_list_init(&ctx.windows);
   wl_list_init(&ctx.unpaired_windows);
   wl_list_init(&ctx.host_outputs);
+  wl_list_init(&ctx.surfaces);
+  wl_list_init(&ctx.staging_blocks);
+  wl_list_init(&ctx.empty_staging_blocks);
   wl_list_init(&ctx.selection_data_source_send_pending);
 
+  // Probe results are only reported with stats, so probing is on by
+  // default only when stats are.
+  if (host_probe_interval ? atoi(host_probe_interval) > 0
+                          : ctx.stats.interval > 0) {
+    sl_host_probe_init(&ctx, host_probe_interval ? atoi(host_probe_interval)
+                                                 : HOST_PROBE_INTERVAL_MS);
+  }
+
   // Parse the list of accelerators that should be reserved by the
   // compositor. Format is "|MODIFIERS|KEYSYM", where MODIFIERS is a
   // list of modifier names (E.g. <Control><Alt>) and KEYSYM is an
@@ -4167,6 +5406,7 @@ int main(int argc, char** argv) {
 
   wl_registry_add_listener(wl_display_get_registry(ctx.display),
                            &sl_registry_listener, &ctx);
+  sl_stats_watch_registry(&ctx);
 
   ctx.client = wl_client_create(ctx.host_display, client_fd);
 
@@ -4174,6 +5414,14 @@ int main(int argc, char** argv) {
   // implement sync handler properly.
   sl_set_display_implementation(&ctx);
 
+  if (calibrate_shm_driver) {
+    ctx.shm_driver = sl_select_shm_driver(&ctx, runtime_dir);
+    if (ctx.shm_driver != SHM_DRIVER_DMABUF && ctx.dma_heap_fd != -1) {
+      close(ctx.dma_heap_fd);
+      ctx.dma_heap_fd = -1;
+    }
+  }
+
   if (ctx.runprog || ctx.xwayland) {
     ctx.sigchld_event_source =
         wl_event_loop_add_signal(event_loop, SIGCHLD, sl_handle_sigchld, &ctx);
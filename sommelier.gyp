@@ -10,6 +10,31 @@
         'peer_cmd_prefix%': '"/opt/google/cros-containers/lib/ld-linux-armhf.so.3 --library-path /opt/google/cros-containers/lib --inhibit-rpath \\"\\""',
       },
     }],
+    ['USE_test == 1', {
+      'targets': [
+        {
+          'target_name': 'sommelier_stream_test',
+          'type': 'executable',
+          'variables': {
+            'deps': [
+              'pixman-1',
+              'wayland-client',
+              'wayland-server',
+              'xcb',
+              'xkbcommon',
+            ],
+          },
+          'dependencies': [
+            'sommelier-protocol',
+          ],
+          'sources': [
+            'sommelier-stream-receiver.c',
+            'sommelier-stream-test.c',
+            'sommelier-stream.c',
+          ],
+        },
+      ],
+    }],
   ],
   'variables': {
     # Set this to the Xwayland path.
@@ -47,6 +72,7 @@
         'protocol/gtk-shell.xml',
         'protocol/keyboard-extension-unstable-v1.xml',
         'protocol/linux-dmabuf-unstable-v1.xml',
+        'protocol/presentation-time.xml',
         'protocol/text-input-unstable-v1.xml',
         'protocol/viewporter.xml',
         'protocol/xdg-shell-unstable-v6.xml',
@@ -65,6 +91,7 @@
           'wayland-server',
           'xcb',
           'xcb-composite',
+          'xcb-sync',
           'xcb-xfixes',
           'xkbcommon',
         ],
@@ -85,9 +112,16 @@
         'sommelier-drm.c',
         'sommelier-gtk-shell.c',
         'sommelier-output.c',
+        'sommelier-perf.c',
+        'sommelier-presentation.c',
+        'sommelier-pressure.c',
+        'sommelier-probe.c',
+        'sommelier-profile.c',
         'sommelier-seat.c',
         'sommelier-shell.c',
         'sommelier-shm.c',
+        'sommelier-stats.c',
+        'sommelier-stream.c',
         'sommelier-subcompositor.c',
         'sommelier-text-input.c',
         'sommelier-viewporter.c',
@@ -144,5 +178,19 @@
         'demos/x11_demo.cc',
       ],
     },
+    {
+      'target_name': 'sommelier_stream_receiver',
+      'type': 'executable',
+      'variables': {
+        'deps': ['wayland-client'],
+      },
+      'dependencies': [
+        'sommelier-protocol',
+      ],
+      'sources': [
+        'demos/stream_receiver.c',
+        'sommelier-stream-receiver.c',
+      ],
+    },
   ],
 }
@@ -35,6 +35,7 @@ struct sl_xdg_shell;
 struct sl_subcompositor;
 struct sl_aura_shell;
 struct sl_viewporter;
+struct sl_presentation;
 struct sl_linux_dmabuf;
 struct sl_keyboard_extension;
 struct sl_text_input_manager;
@@ -66,6 +67,10 @@ enum {
   ATOM_NET_WM_STATE_FULLSCREEN,
   ATOM_NET_WM_STATE_MAXIMIZED_VERT,
   ATOM_NET_WM_STATE_MAXIMIZED_HORZ,
+  ATOM_NET_WM_SYNC_REQUEST,
+  ATOM_NET_WM_SYNC_REQUEST_COUNTER,
+  ATOM_NET_WM_FRAME_DRAWN,
+  ATOM_NET_WM_FRAME_TIMINGS,
   ATOM_CLIPBOARD,
   ATOM_CLIPBOARD_MANAGER,
   ATOM_TARGETS,
@@ -82,6 +87,7 @@ enum {
   SHM_DRIVER_DMABUF,
   SHM_DRIVER_VIRTWL,
   SHM_DRIVER_VIRTWL_DMABUF,
+  SHM_DRIVER_STREAM,
 };
 
 enum {
@@ -89,6 +95,146 @@ enum {
   DATA_DRIVER_VIRTWL,
 };
 
+enum {
+  PACING_AUTO,
+  PACING_FIFO,
+  PACING_MAILBOX,
+};
+
+#define SL_HISTOGRAM_BUCKETS 32
+
+struct sl_histogram {
+  const char* name;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[SL_HISTOGRAM_BUCKETS];
+};
+
+struct sl_transfer_stats {
+  const char* name;
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t iterations;
+  uint64_t time_us;
+};
+
+// State of a single transfer in progress.
+struct sl_transfer {
+  uint64_t start_us;
+  uint64_t bytes;
+  uint64_t iterations;
+};
+
+enum {
+  SL_STARTUP_PHASE_INIT,
+  SL_STARTUP_PHASE_REGISTRY,
+  SL_STARTUP_PHASE_XWAYLAND_READY,
+  SL_STARTUP_PHASE_CONNECT,
+  SL_STARTUP_PHASE_FIRST_COMMIT,
+  SL_STARTUP_PHASE_LAST = SL_STARTUP_PHASE_FIRST_COMMIT,
+};
+
+struct sl_stats {
+  int interval;
+  struct wl_event_source* timer_event_source;
+  uint64_t start_us;
+  uint64_t startup_phases[SL_STARTUP_PHASE_LAST + 1];
+  struct sl_histogram input_latency;
+  struct sl_histogram present_latency;
+  struct sl_histogram map_latency;
+  struct sl_histogram host_rtt;
+  uint64_t x_events;
+  uint64_t x_events_compressed;
+  uint64_t buffer_count;
+  uint64_t buffer_bytes;
+  struct sl_transfer_stats x11_to_wayland;
+  struct sl_transfer_stats wayland_to_x11;
+  struct sl_transfer_stats wayland_to_wayland;
+  struct sl_transfer x11_to_wayland_transfer;
+  struct sl_transfer wayland_to_x11_transfer;
+};
+
+struct sl_memory_pressure {
+  int fd;
+  char* events_path;
+  uint64_t events;
+  struct wl_event_source* event_source;
+};
+
+struct sl_host_probe {
+  int interval;
+  struct wl_event_source* timer_event_source;
+  struct wl_callback* callback;
+  uint64_t sent_us;
+  uint64_t rtt_us;
+  uint64_t jitter_us;
+  int slow;
+};
+
+enum {
+  SL_PERF_CYCLES,
+  SL_PERF_INSTRUCTIONS,
+  SL_PERF_LLC_MISSES,
+  SL_PERF_DTLB_MISSES,
+  SL_PERF_COUNTERS
+};
+
+// The copy is measured separately for each kind of intermediate buffer, as
+// dmabufs are often mapped write-combined rather than cached.
+enum {
+  SL_PERF_STAGE_COPY_SHM,
+  SL_PERF_STAGE_COPY_DMABUF,
+  SL_PERF_STAGE_STREAM,
+  SL_PERF_STAGE_VERIFY,
+  SL_PERF_STAGES
+};
+
+struct sl_perf_sample {
+  uint64_t bytes;
+  uint64_t values[SL_PERF_COUNTERS];
+};
+
+struct sl_perf {
+  int fd;
+  int count;
+  int index[SL_PERF_COUNTERS];
+  struct sl_perf_sample stages[SL_PERF_STAGES];
+};
+
+// Offset from the clock of host presentation timestamps to the clock of
+// sommelier, estimated from the time presentation events are received.
+struct sl_clock_offset {
+  int64_t offset_ns;
+  int64_t window_ns;
+  int samples;
+  int valid;
+};
+
+// Waits for the stream to be written up to the end of what was queued
+// when the wait started.
+struct sl_stream_waiter {
+  struct wl_list link;
+  uint64_t position;
+  void (*done)(struct sl_stream_waiter* waiter);
+};
+
+struct sl_stream {
+  int fd;
+  uint32_t next_buffer_id;
+  uint8_t* scratch;
+  uint8_t* packed;
+  size_t scratch_size;
+  uint8_t* queue;
+  size_t queue_size;
+  size_t queue_capacity;
+  uint64_t written;
+  struct wl_list waiters;
+  struct wl_event_source* event_source;
+  struct wl_event_source* idle_event_source;
+};
+
 struct sl_context {
   char** runprog;
   struct wl_display* display;
@@ -102,6 +248,8 @@ struct sl_context {
   struct sl_xdg_shell* xdg_shell;
   struct sl_aura_shell* aura_shell;
   struct sl_viewporter* viewporter;
+  struct sl_presentation* presentation;
+  struct sl_clock_offset host_clock;
   struct sl_linux_dmabuf* linux_dmabuf;
   struct sl_keyboard_extension* keyboard_extension;
   struct sl_text_input_manager* text_input_manager;
@@ -114,6 +262,12 @@ struct sl_context {
   struct wl_event_source* sigchld_event_source;
   struct wl_array dpi;
   int shm_driver;
+  int shm_hybrid;
+  int idle_trim_timeout;
+  int verify_copy_interval;
+  int verify_copy_fallback;
+  unsigned verify_copy_count;
+  struct wl_event_source* idle_trim_event_source;
   int data_driver;
   int wm_fd;
   int virtwl_fd;
@@ -123,19 +277,26 @@ struct sl_context {
   struct wl_event_source* virtwl_socket_event_source;
   const char* drm_device;
   struct gbm_device* gbm;
+  int dma_heap_fd;
   int xwayland;
   pid_t xwayland_pid;
   pid_t child_pid;
   pid_t peer_pid;
   struct xkb_context* xkb_context;
   struct wl_list accelerators;
+  struct wl_list profiles;
   struct wl_list registries;
   struct wl_list globals;
   struct wl_list host_outputs;
+  struct wl_list surfaces;
+  struct wl_list staging_blocks;
+  struct wl_list empty_staging_blocks;
+  struct wl_event_source* output_settle_event_source;
   int next_global_id;
   xcb_connection_t* connection;
   struct wl_event_source* connection_event_source;
   const xcb_query_extension_reply_t* xfixes_extension;
+  const xcb_query_extension_reply_t* sync_extension;
   xcb_screen_t* screen;
   xcb_window_t window;
   struct wl_list windows, unpaired_windows;
@@ -175,6 +336,12 @@ struct sl_context {
   } atoms[ATOM_LAST + 1];
   xcb_visualid_t visual_ids[256];
   xcb_colormap_t colormaps[256];
+  struct sl_stats stats;
+  struct sl_memory_pressure memory_pressure;
+  struct sl_stream stream;
+  uint32_t next_surface_id;
+  struct sl_host_probe host_probe;
+  struct sl_perf perf;
 };
 
 struct sl_compositor {
@@ -208,6 +375,12 @@ struct sl_host_pointer {
   struct wl_resource* focus_resource;
   struct wl_listener focus_resource_listener;
   uint32_t focus_serial;
+  struct wl_event_source* motion_idle_source;
+  uint32_t motion_time;
+  wl_fixed_t motion_x;
+  wl_fixed_t motion_y;
+  int motion_pending;
+  int motion_frame_pending;
 };
 
 struct sl_relative_pointer_manager {
@@ -227,13 +400,28 @@ struct sl_viewport {
   int32_t dst_height;
 };
 
+// Contents of a commit to copy into an intermediate buffer. Copies for
+// synchronized subsurfaces are deferred until the commit takes effect, so
+// everything the copy depends on is captured at commit time.
+struct sl_surface_copy {
+  struct sl_output_buffer* buffer;
+  struct sl_mmap* shm_mmap;
+  uint32_t width;
+  uint32_t height;
+  int32_t scale;
+  int has_viewport;
+  struct sl_viewport viewport;
+};
+
 struct sl_host_callback {
   struct wl_resource* resource;
   struct wl_callback* proxy;
+  struct sl_stream_waiter stream_waiter;
 };
 
 struct sl_host_surface {
   struct sl_context* ctx;
+  uint32_t id;
   struct wl_resource* resource;
   struct wl_surface* proxy;
   struct wp_viewport* viewport;
@@ -248,6 +436,38 @@ struct sl_host_surface {
   struct sl_output_buffer* current_buffer;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  uint64_t input_time_us;
+  int idle;
+  int idle_trim;
+  int copy_full;
+  int queue_depth;
+  int coalesce_input;
+  struct sl_perf_sample perf;
+  struct sl_host_surface* subsurface_parent;
+  int subsurface_sync;
+  struct sl_surface_copy pending_copy;
+  struct wl_list pending_children;
+  struct wl_list pending_link;
+  struct wl_callback* pacing_callback;
+  struct wl_event_source* pacing_timeout_event_source;
+  struct sl_stream_waiter pacing_waiter;
+  struct wl_list stream_frame_callbacks;
+  struct wl_event_source* deadline_event_source;
+  int deadline_armed;
+  struct wp_presentation_feedback* presentation_feedback;
+  struct wl_list presentation_feedbacks;
+  uint64_t present_us;
+  uint64_t refresh_us;
+  uint64_t pacing_commit_us;
+  uint64_t frame_done_us;
+  uint64_t frame_latency_us;
+  struct sl_histogram frame_interval;
+  int pacing;
+  int buffer_attached;
+  int commit_held;
+  int forwarded_attach;
+  struct sl_output_buffer* pending_buffer;
+  struct wl_list link;
 };
 
 struct sl_host_region {
@@ -293,6 +513,19 @@ struct sl_output {
   struct wl_list link;
 };
 
+// Output state as sent to clients, derived from host output state.
+struct sl_host_output_state {
+  int scale;
+  int physical_width;
+  int physical_height;
+  int width;
+  int height;
+  int subpixel;
+  int transform;
+  int flags;
+  int refresh;
+};
+
 struct sl_host_output {
   struct sl_context* ctx;
   struct wl_resource* resource;
@@ -316,6 +549,9 @@ struct sl_host_output {
   int preferred_scale;
   int device_scale_factor;
   int expecting_scale;
+  int state_sent;
+  int state_forced;
+  struct sl_host_output_state sent_state;
   struct wl_list link;
 };
 
@@ -373,6 +609,13 @@ struct sl_viewporter {
   struct wp_viewporter* internal;
 };
 
+struct sl_presentation {
+  struct sl_context* ctx;
+  uint32_t id;
+  struct sl_global* host_global;
+  struct wp_presentation* internal;
+};
+
 struct sl_xdg_shell {
   struct sl_context* ctx;
   uint32_t id;
@@ -412,6 +655,23 @@ struct sl_host_registry {
   struct wl_list link;
 };
 
+// Fixed size object allocator for wrapper objects that are created and
+// destroyed at a high rate, such as frame callbacks. Objects are carved out
+// of chunks and freed objects are kept on a free list for reuse. Chunks
+// are only returned to the system by sl_slab_trim() once they are empty.
+struct sl_slab_chunk;
+
+struct sl_slab {
+  size_t object_size;
+  void* free_list;
+  struct sl_slab_chunk* chunks;
+  struct sl_slab* next;
+  int registered;
+};
+
+#define SL_SLAB_INIT(type) \
+  { sizeof(type), NULL, NULL, NULL, 0 }
+
 typedef void (*sl_begin_end_access_func_t)(int fd);
 
 struct sl_mmap {
@@ -445,6 +705,18 @@ struct sl_config {
   uint32_t states[3];
 };
 
+struct sl_profile {
+  char* match;
+  int frame_sync;
+  int idle_trim;
+  int copy_full;
+  int pacing;
+  int queue_depth;
+  int coalesce_input;
+  char* shm_driver;
+  struct wl_list link;
+};
+
 struct sl_window {
   struct sl_context* ctx;
   xcb_window_t id;
@@ -476,6 +748,20 @@ struct sl_window {
   int max_height;
   struct sl_config next_config;
   struct sl_config pending_config;
+  uint32_t sync_counter;
+  uint32_t sync_alarm;
+  int sync_extended;
+  int64_t sync_value;
+  int64_t sync_counter_value;
+  int sync_pending;
+  int sync_drawn;
+  struct wl_event_source* sync_timeout_event_source;
+  int sync_request;
+  int frame_pending;
+  int frame_drawn_pending;
+  uint64_t frame_commit_us;
+  struct sl_profile* profile;
+  uint64_t map_us;
   struct zxdg_surface_v6* xdg_surface;
   struct zxdg_toplevel_v6* xdg_toplevel;
   struct zxdg_popup_v6* xdg_popup;
@@ -501,6 +787,8 @@ size_t sl_shm_bpp_for_shm_format(uint32_t format);
 
 size_t sl_shm_num_planes_for_shm_format(uint32_t format);
 
+const char* sl_shm_driver_name(int shm_driver);
+
 struct sl_global* sl_shm_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_subcompositor_global_create(struct sl_context* ctx);
@@ -522,6 +810,8 @@ struct sl_global* sl_data_device_manager_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_viewporter_global_create(struct sl_context* ctx);
 
+struct sl_global* sl_presentation_global_create(struct sl_context* ctx);
+
 struct sl_global* sl_xdg_shell_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_gtk_shell_global_create(struct sl_context* ctx);
@@ -544,8 +834,86 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t stride1,
                                size_t y_ss0,
                                size_t y_ss1);
+struct sl_mmap* sl_mmap_create_at(int fd,
+                                  size_t map_offset,
+                                  size_t size,
+                                  size_t bpp,
+                                  size_t num_planes,
+                                  size_t offset0,
+                                  size_t stride0,
+                                  size_t offset1,
+                                  size_t stride1,
+                                  size_t y_ss0,
+                                  size_t y_ss1);
+int sl_dma_heap_alloc(struct sl_context* ctx,
+                      size_t width,
+                      size_t height,
+                      size_t bpp,
+                      size_t* stride);
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map);
 void sl_mmap_unref(struct sl_mmap* map);
+size_t sl_mmap_length(struct sl_mmap* map);
+void sl_dmabuf_begin_write(int fd);
+void sl_dmabuf_end_write(int fd);
+void sl_virtwl_dmabuf_begin_write(int fd);
+void sl_virtwl_dmabuf_end_write(int fd);
+
+size_t sl_host_surface_release_buffers(struct sl_host_surface* host);
+void sl_host_surface_link_pending_copy(struct sl_host_surface* host);
+void sl_host_surface_discard_pending_copy(struct sl_host_surface* host);
+void sl_host_surface_resolve_pending_copies(struct sl_host_surface* host);
+int sl_host_surface_forward_commit(struct sl_host_surface* host);
+int sl_host_surface_mailbox(struct sl_host_surface* host);
+void sl_host_surface_track_presentation(struct sl_host_surface* host);
+void sl_host_surface_presentation_commit(struct sl_host_surface* host);
+void sl_idle_trim_init(struct sl_context* ctx);
+size_t sl_staging_trim(struct sl_context* ctx);
+void sl_memory_pressure_init(struct sl_context* ctx);
+
+void sl_host_probe_init(struct sl_context* ctx, int interval);
+
+void sl_stream_init(struct sl_context* ctx, int fd);
+uint32_t sl_stream_buffer_create(struct sl_context* ctx,
+                                 uint32_t width,
+                                 uint32_t height,
+                                 uint32_t format,
+                                 struct sl_mmap* map);
+void sl_stream_buffer_destroy(struct sl_context* ctx, uint32_t buffer_id);
+void sl_stream_damage(struct sl_context* ctx,
+                      uint32_t buffer_id,
+                      uint8_t* dst_base,
+                      uint8_t* dst,
+                      size_t dst_stride,
+                      uint8_t* src,
+                      size_t src_stride,
+                      size_t row_bytes,
+                      size_t rows,
+                      int delta);
+void sl_stream_commit(struct sl_context* ctx,
+                      uint32_t surface_id,
+                      uint32_t buffer_id);
+int sl_stream_congested(struct sl_context* ctx);
+void sl_stream_wait(struct sl_context* ctx, struct sl_stream_waiter* waiter);
+
+void sl_perf_init(struct sl_context* ctx);
+void sl_perf_read(struct sl_context* ctx, uint64_t* values);
+void sl_perf_add(struct sl_context* ctx,
+                 int stage,
+                 const uint64_t* start,
+                 size_t bytes,
+                 struct sl_perf_sample* surface);
+void sl_perf_report(struct sl_context* ctx);
+
+void sl_profiles_load(struct sl_context* ctx, const char* path);
+struct sl_profile* sl_profile_find(struct sl_context* ctx, const char* app_id);
+void sl_profile_apply(struct sl_profile* profile,
+                      struct sl_host_surface* host_surface);
+
+void* sl_slab_alloc(struct sl_slab* slab);
+void sl_slab_free(struct sl_slab* slab, void* object);
+size_t sl_slab_trim(void);
+
+extern struct sl_slab sl_host_callback_slab;
 
 struct sl_sync_point* sl_sync_point_create(int fd);
 void sl_sync_point_destroy(struct sl_sync_point* sync_point);
@@ -562,4 +930,24 @@ int sl_process_pending_configure_acks(struct sl_window* window,
 
 void sl_window_update(struct sl_window* window);
 
+void sl_window_request_frame(struct sl_window* window);
+void sl_window_frame_done(struct sl_window* window);
+
+uint64_t sl_now_us(void);
+void sl_histogram_init(struct sl_histogram* histogram, const char* name);
+void sl_histogram_add(struct sl_histogram* histogram, uint64_t value);
+void sl_stats_init(struct sl_context* ctx, int interval);
+void sl_stats_report(struct sl_context* ctx);
+void sl_stats_watch_registry(struct sl_context* ctx);
+void sl_stats_startup_phase(struct sl_context* ctx, int phase);
+void sl_stats_input_event(struct sl_context* ctx,
+                          struct wl_resource* surface_resource);
+void sl_stats_surface_commit(struct sl_host_surface* host_surface);
+void sl_stats_window_realized(struct sl_window* window);
+void sl_transfer_begin(struct sl_context* ctx, struct sl_transfer* transfer);
+void sl_transfer_progress(struct sl_transfer* transfer, ssize_t bytes);
+void sl_transfer_end(struct sl_context* ctx,
+                     struct sl_transfer_stats* stats,
+                     struct sl_transfer* transfer);
+
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_H_